@@ -0,0 +1,479 @@
+// Native benchmarks of the lighting core
+//
+// Replays a recorded schedule and a PIR trace through the code the input and
+// render tasks run, and reports ns/op and heap allocations per op, failing
+// with a non-zero exit if any of it allocates or a check is off. The render
+// pipeline counts one op per pixel, the fleet replay one per fetch and the
+// telemetry encoder one per event. Run with
+// `pio run -e native -t exec` from iot/, or pass other recordings:
+// `.pio/build/native/program <schedule.txt> <pir.txt>`.
+
+#include "color_correction.h"
+#include "kelvin_rgb.h"
+#include "lighting.h"
+#include "refresh_timer.h"
+#include "telemetry_encoding.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <new>
+#include <vector>
+
+// Every operator new counts, which covers the standard library containers
+// and algorithms the core could pull in
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size) {
+  ++allocations;
+  if (void *pointer = malloc(size ? size : 1))
+    return pointer;
+  throw std::bad_alloc();
+}
+void *operator new[](size_t size) { return operator new(size); }
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  ++allocations;
+  return malloc(size ? size : 1);
+}
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept {
+  return operator new(size, tag);
+}
+void operator delete(void *pointer) noexcept { free(pointer); }
+void operator delete[](void *pointer) noexcept { free(pointer); }
+void operator delete(void *pointer, size_t) noexcept { free(pointer); }
+void operator delete[](void *pointer, size_t) noexcept { free(pointer); }
+void operator delete(void *pointer, const std::nothrow_t &) noexcept { free(pointer); }
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept { free(pointer); }
+
+const double MIN_BENCH_SECONDS = 0.2; // Per benchmark, repeats the replay
+const unsigned long REPLAY_STEP_MS = LOOP_DELAY_MS; // Input task cadence
+
+struct PirEdge {
+  unsigned long ms;
+  bool level;
+};
+
+static volatile uint64_t sink; // Keeps results observable
+static int failures = 0;        // Exit status, checks print what failed
+
+__attribute__((format(printf, 1, 2))) static void fail(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  printf("FAIL: ");
+  vprintf(format, args);
+  printf("\n");
+  va_end(args);
+  ++failures;
+}
+
+// Tanner Helland's formula in libm doubles, what kelvin_rgb.h tabulates
+static PixelColor referenceKelvinRgb(int kelvin) {
+  auto clamp = [](double value) {
+    return (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+  };
+  double temp = kelvin / 100.0;
+  PixelColor rgb = {255, 255, 255};
+  if (temp > 66) {
+    rgb.r = clamp(329.698727446 * std::pow(temp - 60, -0.1332047592));
+    rgb.g = clamp(288.1221695283 * std::pow(temp - 60, -0.0755148492));
+  } else {
+    rgb.g = clamp(99.4708025861 * std::log(temp) - 161.1195681661);
+  }
+  if (temp <= 19)
+    rgb.b = 0;
+  else if (temp < 66)
+    rgb.b = clamp(138.5177312231 * std::log(temp - 10) - 305.0447927307);
+  return rgb;
+}
+
+static bool loadSchedule(const char *path, LightingSchedule &target) {
+  FILE *file = fopen(path, "r");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open schedule %s\n", path);
+    return false;
+  }
+
+  char line[128];
+  target.pointCount = 0;
+  while (fgets(line, sizeof(line), file) != nullptr) {
+    long long a, b;
+    long c, d;
+    int night;
+    if (sscanf(line, "profile %ld %lld %lld", &c, &a, &b) == 3) {
+      target.profileId = c;
+      target.generatedAt = a;
+      target.validUntil = b;
+    } else if (sscanf(line, "sleep %ld %ld %d", &c, &d, &night) == 3) {
+      target.sleepStartUtcSeconds = c;
+      target.sleepEndUtcSeconds = d;
+      target.nightModeEnabled = night != 0;
+    } else if (sscanf(line, "motion_timeout %ld", &c) == 1) {
+      target.motionTimeoutSeconds = c;
+    } else if (sscanf(line, "point %lld %ld", &a, &c) == 2 &&
+               target.pointCount < API_MAX_SCHEDULE_SIZE) {
+      target.points[target.pointCount].timestamp = a;
+      target.points[target.pointCount].colorTemp = c;
+      ++target.pointCount;
+    }
+  }
+  fclose(file);
+
+  indexSchedule(target);
+  return target.dayPointCount > 0;
+}
+
+static bool loadPirTrace(const char *path, std::vector<PirEdge> &edges) {
+  FILE *file = fopen(path, "r");
+  if (file == nullptr) {
+    fprintf(stderr, "Cannot open PIR trace %s\n", path);
+    return false;
+  }
+
+  char line[64];
+  unsigned long ms;
+  int level;
+  while (fgets(line, sizeof(line), file) != nullptr)
+    if (sscanf(line, "%lu %d", &ms, &level) == 2)
+      edges.push_back({ms, level != 0});
+  fclose(file);
+  return !edges.empty();
+}
+
+// Runs `pass` until MIN_BENCH_SECONDS have passed, `pass` returns its ops
+template <typename Pass> static void bench(const char *name, Pass pass) {
+  using Clock = std::chrono::steady_clock;
+
+  uint64_t ops = 0;
+  uint64_t allocationsBefore = allocations;
+  Clock::time_point start = Clock::now();
+  double elapsed;
+  do {
+    ops += pass();
+    elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  } while (elapsed < MIN_BENCH_SECONDS);
+
+  uint64_t allocated = allocations - allocationsBefore;
+  printf("%-28s %12llu %10.1f %12.3f\n", name, (unsigned long long)ops,
+         elapsed * 1e9 / ops, (double)allocated / ops);
+  // The core runs in the input and render tasks, which must not allocate
+  if (allocated > 0)
+    fail("%s allocates", name);
+}
+
+int main(int argc, char **argv) {
+  const char *schedulePath = argc > 1 ? argv[1] : "bench/data/schedule_day.txt";
+  const char *pirPath = argc > 2 ? argv[2] : "bench/data/pir_day.txt";
+
+  static LightingSchedule schedule;
+  std::vector<PirEdge> edges;
+  if (!loadSchedule(schedulePath, schedule) || !loadPirTrace(pirPath, edges))
+    return 1;
+
+  printf("Schedule: %d points, %d times of day\n", schedule.pointCount,
+         schedule.dayPointCount);
+  printf("PIR trace: %zu edges over %.1f h\n\n", edges.size(),
+         edges.back().ms / 3600000.0);
+  printf("%-28s %12s %10s %12s\n", "benchmark", "ops", "ns/op", "allocs/op");
+
+  time_t dayStart = schedule.generatedAt - schedule.generatedAt % SECONDS_PER_DAY;
+
+  // What updateLighting() and handleMotion() do, once per second of a day
+  bench("scheduleColorTemp/replay", [&] {
+    uint64_t sum = 0;
+    for (time_t now = dayStart; now < dayStart + SECONDS_PER_DAY; ++now)
+      sum += scheduleColorTemp(schedule, now);
+    sink = sink + sum;
+    return (uint64_t)SECONDS_PER_DAY;
+  });
+
+  // Any time of the week, the per-minute table makes it the same array index
+  bench("scheduleColorTemp/random", [&] {
+    const int ops = 65536;
+    uint32_t random = 12345;
+    uint64_t sum = 0;
+    for (int i = 0; i < ops; ++i) {
+      random = random * 1664525 + 1013904223;
+      sum += scheduleColorTemp(schedule, dayStart + random % (7 * SECONDS_PER_DAY));
+    }
+    sink = sink + sum;
+    return (uint64_t)ops;
+  });
+
+  bench("isNightTime", [&] {
+    uint64_t count = 0;
+    for (uint32_t daySeconds = 0; daySeconds < SECONDS_PER_DAY; ++daySeconds)
+      count += isNightTime(schedule, daySeconds);
+    sink = sink + count;
+    return (uint64_t)SECONDS_PER_DAY;
+  });
+
+  // What scheduleColorTemp() asks, cached until the next window boundary
+  bench("scheduleIsNight", [&] {
+    uint64_t count = 0;
+    for (time_t now = dayStart; now < dayStart + SECONDS_PER_DAY; ++now)
+      count += scheduleIsNight(schedule, now);
+    sink = sink + count;
+    return (uint64_t)SECONDS_PER_DAY;
+  });
+
+  // The input task tick at LOOP_DELAY_MS over a day
+  bench("timeBaseTick", [&] {
+    TimeBase base;
+    uint64_t jumps = 0, ops = 0;
+    for (unsigned long nowMs = 1; nowMs < SECONDS_PER_DAY * 1000UL;
+         nowMs += LOOP_DELAY_MS, ++ops) {
+      timeBaseTick(base, dayStart + nowMs / 1000, nowMs);
+      jumps += base.jumpSeconds != 0;
+    }
+    sink = sink + jumps + base.daySeconds;
+    return ops;
+  });
+
+  // Every kelvin renderFrame() can be asked for
+  bench("convertColorTempToRGB", [&] {
+    uint64_t sum = 0;
+    for (int kelvin = MIN_COLOR_TEMP_K; kelvin <= 10000; ++kelvin) {
+      uint8_t r, g, b;
+      convertColorTempToRGB(kelvin, &r, &g, &b);
+      sum += r + g + b;
+    }
+    sink = sink + sum;
+    return (uint64_t)(10000 - MIN_COLOR_TEMP_K + 1);
+  });
+
+  // Table entries are the formula itself, interpolation between them rounds
+  // down, also next to the branch switch at 6600 K
+  int worstKelvinError = 0;
+  for (int kelvin = MIN_COLOR_TEMP_K; kelvin <= 10000; ++kelvin) {
+    PixelColor table, reference = referenceKelvinRgb(kelvin);
+    convertColorTempToRGB(kelvin, &table.r, &table.g, &table.b);
+    int error = std::max({abs(table.r - reference.r), abs(table.g - reference.g),
+                          abs(table.b - reference.b)});
+    worstKelvinError = std::max(worstKelvinError, error);
+    if (error > ((kelvin - MIN_COLOR_TEMP_K) % KELVIN_TABLE_STEP_K == 0 ? 0 : 1))
+      fail("%d K is %u/%u/%u, the formula gives %u/%u/%u", kelvin, table.r, table.g,
+           table.b, reference.r, reference.g, reference.b);
+  }
+
+  // renderFrame() of a long strip at every brightness of a fade
+  const int stripPixels = 300;
+  static PixelColor pixels[stripPixels];
+  const ZoneEffect effects[] = {EFFECT_SOLID, EFFECT_GRADIENT, EFFECT_SUNRISE};
+  const char *const effectNames[] = {"renderZonePixels/solid",
+                                     "renderZonePixels/gradient",
+                                     "renderZonePixels/sunrise"};
+  for (int effect = 0; effect < 3; ++effect) {
+    bench(effectNames[effect], [&] {
+      uint64_t sum = 0;
+      for (int brightness = 0; brightness <= PWM_MAX_VALUE; ++brightness) {
+        renderZonePixels(effects[effect], DEFAULT_COLOR_TEMP_K, brightness,
+                         brightness, brightness, pixels, stripPixels);
+        sum += pixels[stripPixels / 2].r;
+      }
+      sink = sink + sum;
+      return (uint64_t)(PWM_MAX_VALUE + 1) * stripPixels;
+    });
+  }
+
+  // Dim pixels keep their hue: averaged over the dither phases each channel
+  // comes within 1/10 count of its ideal linear duty, of which a warm white
+  // at 11 % has less than one count per channel
+  double worstDimError = 0;
+  for (int brightness = 1; brightness <= PWM_MAX_VALUE; ++brightness) {
+    uint8_t base[3];
+    convertColorTempToRGB(DEFAULT_COLOR_TEMP_K, &base[0], &base[1], &base[2]);
+    const int balance[3] = {LED_WHITE_BALANCE_R, LED_WHITE_BALANCE_G,
+                            LED_WHITE_BALANCE_B};
+    unsigned sum[3] = {0, 0, 0};
+    for (int frame = 0; frame < DITHER_PHASES; ++frame) {
+      PixelColor pixel;
+      renderZonePixels(EFFECT_SOLID, DEFAULT_COLOR_TEMP_K, brightness, 255, frame,
+                       &pixel, 1);
+      sum[0] += pixel.r;
+      sum[1] += pixel.g;
+      sum[2] += pixel.b;
+    }
+    for (int channel = 0; channel < 3; ++channel) {
+      double ideal = std::pow(base[channel] / 255.0, LED_GAMMA) *
+                     std::pow(brightness / 255.0, LED_GAMMA) * balance[channel];
+      double error = std::fabs((double)sum[channel] / DITHER_PHASES - ideal);
+      bool dim = ideal < DITHER_MAX_COUNT - 1;
+      if (dim)
+        worstDimError = std::max(worstDimError, error);
+      if (error > (dim ? 0.1 : 0.6))
+        fail("Channel %d at brightness %d averages %.2f, ideal %.2f", channel,
+             brightness, (double)sum[channel] / DITHER_PHASES, ideal);
+    }
+  }
+
+  // handleMotion() at the input task cadence over the whole trace, edges go
+  // into the filter as handlePirEdge() does. The noisy copy adds 30 ms
+  // glitches that must neither switch the light nor keep it on.
+  std::vector<PirEdge> noisyEdges;
+  uint32_t random = 54321;
+  for (size_t i = 0; i < edges.size(); ++i) {
+    noisyEdges.push_back(edges[i]);
+    unsigned long nextMs = i + 1 < edges.size() ? edges[i + 1].ms : edges[i].ms;
+    random = random * 1664525 + 1013904223;
+    unsigned long glitchMs = edges[i].ms + 1000 + random % 60000;
+    if (!edges[i].level && glitchMs + 30 < nextMs) {
+      noisyEdges.push_back({glitchMs, true});
+      noisyEdges.push_back({glitchMs + 30, false});
+    }
+  }
+
+  struct Replay {
+    unsigned long arrivals, departures;
+    unsigned long lastDepartureMs;
+  };
+  auto replay = [&](const std::vector<PirEdge> &trace, Replay &result) {
+    unsigned long timeoutMs = (unsigned long)schedule.motionTimeoutSeconds * 1000;
+    unsigned long endMs =
+        trace.back().ms + OCCUPANCY_TIMEOUT_MAX_FACTOR * timeoutMs + REPLAY_STEP_MS;
+    OccupancyFilter filter;
+    size_t next = 0;
+    bool level = false;
+    uint64_t ops = 0;
+    result = {0, 0, 0};
+
+    for (unsigned long nowMs = 0; nowMs < endMs; nowMs += REPLAY_STEP_MS, ++ops) {
+      for (; next < trace.size() && trace[next].ms <= nowMs; ++next, ++ops) {
+        level = trace[next].level;
+        occupancySample(filter, level, trace[next].ms);
+      }
+
+      switch (occupancyUpdate(filter, level, nowMs, timeoutMs)) {
+      case OCCUPANCY_ARRIVED:
+        ++result.arrivals;
+        break;
+      case OCCUPANCY_LEFT:
+        ++result.departures;
+        result.lastDepartureMs = nowMs;
+        break;
+      case OCCUPANCY_NONE:
+        break;
+      }
+    }
+    return ops;
+  };
+
+  Replay clean, noisy;
+  bench("occupancy/replay", [&] { return replay(edges, clean); });
+  bench("occupancy/noisy", [&] { return replay(noisyEdges, noisy); });
+  if (noisy.arrivals != clean.arrivals || noisy.departures != clean.departures)
+    fail("Glitches changed the visits to %lu arrivals, %lu departures",
+         noisy.arrivals, noisy.departures);
+
+  // A minute of presence, then only glitches for an hour, one per window at
+  // most (4 to 30 s apart). The zone must go vacant at the timeout after the
+  // last real motion.
+  const unsigned long presenceEndMs = 60000;
+  std::vector<PirEdge> vacated = {{1000, true}, {presenceEndMs, false}};
+  for (unsigned long glitchMs = presenceEndMs; glitchMs < 3600000;) {
+    random = random * 1664525 + 1013904223;
+    glitchMs += OCCUPANCY_WINDOW_SLOTS * OCCUPANCY_SLOT_MS + 800 + random % 26000;
+    vacated.push_back({glitchMs, true});
+    vacated.push_back({glitchMs + 30, false});
+  }
+  Replay left;
+  replay(vacated, left);
+  OccupancyFilter expected;
+  occupancyUpdate(expected, true, 1000, 0);
+  occupancyUpdate(expected, true, 1300, 0);
+  occupancyUpdate(expected, false, presenceEndMs, 0);
+  unsigned long dueMs =
+      presenceEndMs +
+      occupancyTimeoutMs(expected, (unsigned long)schedule.motionTimeoutSeconds * 1000);
+  if (left.arrivals != 1 || left.departures != 1 ||
+      left.lastDepartureMs < dueMs || left.lastDepartureMs > dueMs + REPLAY_STEP_MS)
+    fail("Vacated zone: %lu arrivals, %lu departures, left at %lu ms, due at %lu ms",
+         left.arrivals, left.departures, left.lastDepartureMs, dueMs);
+
+  // Once per fetched or restored schedule
+  bench("indexSchedule", [&] {
+    static LightingSchedule copy;
+    copy = schedule;
+    indexSchedule(copy);
+    sink = sink + copy.dayPointCount;
+    return (uint64_t)1;
+  });
+
+  // Schedule fetches of a fleet over two days after a site-wide power
+  // restore, as networkTask times them: all boot with the clock unsynced,
+  // reconnect together and get a fresh schedule on every fetch
+  const int fleetSize = 1000;
+  const unsigned long fleetReconnectMs = 3000;
+  const unsigned long fleetHorizonMs = 2 * SECONDS_PER_DAY * 1000UL;
+  const time_t restoredAt = dayStart + 8 * 3600;
+  static uint32_t fetchesPerSecond[2 * SECONDS_PER_DAY];
+  bench("refresh/fleet", [&] {
+    std::fill(std::begin(fetchesPerSecond), std::end(fetchesPerSecond), 0);
+    uint64_t ops = 0;
+    for (int device = 0; device < fleetSize; ++device) {
+      char key[API_KEY_LENGTH + 1];
+      snprintf(key, sizeof(key), "device-%04d", device);
+
+      RefreshTimer timer;
+      refreshBegin(timer, refreshSeed(key), 0);
+      refreshAfter(timer, 0, scheduleRefreshDelayMs(0, 0), SCHEDULE_REFRESH_JITTER_MS);
+      refreshWithin(timer, fleetReconnectMs, FLEET_SPREAD_MS);
+
+      for (; timer.dueMs < fleetHorizonMs; ++ops) {
+        ++fetchesPerSecond[timer.dueMs / 1000];
+        time_t now = restoredAt + timer.dueMs / 1000;
+        // Generated on the server's 15 minute grid, valid for a day
+        time_t validUntil = now - now % 900 + SECONDS_PER_DAY;
+        refreshAfter(timer, timer.dueMs, scheduleRefreshDelayMs(validUntil, now),
+                     SCHEDULE_REFRESH_JITTER_MS);
+      }
+    }
+    sink = sink + ops;
+    return ops;
+  });
+
+  // The PIR trace as the telemetry it causes, arrivals and departures each
+  // with the state and colour temperature of the moment
+  std::vector<SpooledEvent> events;
+  for (const PirEdge &edge : edges) {
+    time_t now = dayStart + edge.ms / 1000;
+    events.push_back({(uint32_t)now, (uint16_t)scheduleColorTemp(schedule, now),
+                      (uint8_t)(edge.level ? 0 : 1), 80,
+                      (uint8_t)(edge.level ? SPOOLED_MOTION_DETECTED | SPOOLED_LIGHT_IS_ON
+                                           : 0)});
+  }
+  size_t encodedBytes = 0;
+  bench("telemetry/encode", [&] {
+    static uint8_t payload[TELEMETRY_BINARY_PAYLOAD_SIZE];
+    encodedBytes = 0;
+    for (size_t i = 0; i < events.size(); i += TELEMETRY_BATCH_SIZE) {
+      int count = (int)std::min(events.size() - i, (size_t)TELEMETRY_BATCH_SIZE);
+      encodedBytes += encodeTelemetryBatch(
+          &events[i], count, TELEMETRY_BINARY_MAX_EVENT_TYPES, payload, sizeof(payload));
+    }
+    sink = sink + encodedBytes;
+    return (uint64_t)events.size();
+  });
+
+  uint32_t reconnectPeak = 0, steadyPeak = 0;
+  for (uint32_t second = 0; second < 2 * SECONDS_PER_DAY; ++second) {
+    uint32_t &peak = second < FLEET_SPREAD_MS / 1000 + fleetReconnectMs / 1000
+                         ? reconnectPeak
+                         : steadyPeak;
+    peak = std::max(peak, fetchesPerSecond[second]);
+  }
+
+  printf("\nOccupancy replay: %lu arrivals, %lu departures\n", clean.arrivals,
+         clean.departures);
+  printf("With %zu glitches: %lu arrivals, %lu departures\n",
+         (noisyEdges.size() - edges.size()) / 2, noisy.arrivals, noisy.departures);
+  printf("Vacated with %zu glitches: left %.1f s after the last motion\n",
+         (vacated.size() - 2) / 2, (left.lastDepartureMs - presenceEndMs) / 1000.0);
+  printf("Fleet of %d: peak %u fetches/s after the power restore, %u/s later\n",
+         fleetSize, reconnectPeak, steadyPeak);
+  printf("Kelvin table: within %d of the formula\n", worstKelvinError);
+  printf("Dim pixels: channels within %.3f counts of linear\n", worstDimError);
+  printf("Telemetry: %zu events in %zu bytes, %.1f bytes/event\n", events.size(),
+         encodedBytes, (double)encodedBytes / events.size());
+  return failures > 0 ? 1 : 0;
+}
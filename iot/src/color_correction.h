@@ -0,0 +1,62 @@
+// Gamma, white balance and dither tables generated at compile time
+//
+// The render pipeline scales in linear light with 8 fractional bits per LED
+// count, so a dim pixel keeps the ratio of its channels instead of each of
+// them being rounded to a whole count on its own.
+#ifndef LUMIRUM_COLOR_CORRECTION_H
+#define LUMIRUM_COLOR_CORRECTION_H
+#include "config.h"
+#include "kelvin_rgb.h" // kelvin_detail::pow
+#include <array>
+
+using LinearTable = std::array<uint16_t, 256>;
+
+const int DITHER_PHASES = 16; // Frames until the dither pattern repeats
+using DitherTable = std::array<uint8_t, DITHER_PHASES>;
+
+namespace color_detail {
+
+// Perceived level to linear light from 0 to 65535, the LEDs are linear and
+// the eye is not
+constexpr LinearTable buildGamma() {
+  LinearTable table = {};
+  for (int value = 1; value < 256; ++value)
+    table[value] =
+        (uint16_t)(kelvin_detail::pow(value / 255.0, LED_GAMMA) * 65535.0 + 0.5);
+  return table;
+}
+
+// Perceived channel value to LED duty at full brightness in 1/256 counts,
+// white balanced to `scale` of 255
+constexpr LinearTable buildChannel(const LinearTable &gamma, int scale) {
+  LinearTable table = {};
+  for (int value = 0; value < 256; ++value)
+    table[value] = (uint16_t)((gamma[value] * (uint64_t)scale * 256 + 32767) / 65535);
+  return table;
+}
+
+// Rounding thresholds in bit-reversed order, any run of frames spreads the
+// rounded up ones evenly
+constexpr DitherTable buildDither() {
+  DitherTable table = {};
+  for (int phase = 0; phase < DITHER_PHASES; ++phase) {
+    int reversed = ((phase & 1) << 3) | ((phase & 2) << 1) | ((phase & 4) >> 1) |
+                   ((phase & 8) >> 3);
+    table[phase] = (uint8_t)(reversed * 16 + 8);
+  }
+  return table;
+}
+
+} // namespace color_detail
+
+// Brightness of a pixel, applied to the channel duties below
+constexpr LinearTable GAMMA_TABLE = color_detail::buildGamma();
+
+// What the render loop indexes with the kelvin colour, one table per channel
+constexpr LinearTable CHANNEL_R = color_detail::buildChannel(GAMMA_TABLE, LED_WHITE_BALANCE_R);
+constexpr LinearTable CHANNEL_G = color_detail::buildChannel(GAMMA_TABLE, LED_WHITE_BALANCE_G);
+constexpr LinearTable CHANNEL_B = color_detail::buildChannel(GAMMA_TABLE, LED_WHITE_BALANCE_B);
+
+constexpr DitherTable DITHER_THRESHOLDS = color_detail::buildDither();
+
+#endif // LUMIRUM_COLOR_CORRECTION_H
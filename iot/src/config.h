@@ -1,7 +1,7 @@
 // Device Configuration
 #ifndef LUMIRUM_CONFIG_H
 #define LUMIRUM_CONFIG_H
-#include <Arduino.h> // for time_t type
+#include "hal.h" // Arduino.h, or its stand-ins on native
 
 // WiFi Credentials
 // WARNING: the " must stay intact
@@ -11,16 +11,39 @@
 // Network & API Configuration
 #define API_BASE_URL "http://192.168.18.103:3000"
 #define API_FETCH_ROUTE "/devices/circadian"
+#define API_WATCH_ROUTE API_FETCH_ROUTE "/watch" // Long poll for changes
 #define API_TELEMETRY_ROUTE "/telemetry"
+#define API_TELEMETRY_BATCH_ROUTE API_TELEMETRY_ROUTE "/batch"
 #define API_KEY_HEADER "x-api-key"
 
 const int API_KEY_LENGTH = 64; // chars
 #define API_DEVICE_KEY "GItGdmXxqGdEiDQOXzrzPgX1920KhsC2y1nxffrPeMSggp0DrYRjZwHL3PkWkw9A"
 const bool TELEMETRY = true; // Whether to send telemetry to the API
+const int TELEMETRY_QUEUE_LENGTH = 16; // events buffered while the network is busy
+const int TELEMETRY_BATCH_SIZE = 20;   // events per upload
+const bool TELEMETRY_BINARY = true; // Compact batches, JSON if the server refuses
+const unsigned long TELEMETRY_BINARY_RETRY_MS = 3600000; // JSON after a refusal, then binary again
+const int TELEMETRY_SPOOL_LENGTH = 128;     // events kept in RAM while offline
+const int TELEMETRY_SPOOL_NVS_CHUNKS = 16;  // batches spilled to NVS, 0 disables
 
-const int MAX_WIFI_ATTEMPTS = 20;
-const int WIFI_RETRY_DELAY_MS = 500; // 0.5 seconds between connection attempts
+const unsigned long WIFI_CONNECT_TIMEOUT_MS = 10000; // per connection attempt
+const unsigned long WIFI_BACKOFF_MIN_MS = 1000;      // first reconnect delay
+const unsigned long WIFI_BACKOFF_MAX_MS = 300000;    // doubles up to 5 minutes
+const unsigned long SCHEDULE_WATCH_TIMEOUT_MS = 960000; // server answers within 15 minutes
+const int SCHEDULE_WATCH_KEEPALIVE_S = 60;   // idle before TCP keep-alive probes, keeps NAT mappings
+const uint32_t SCHEDULE_WATCH_READ_TIMEOUT_S = 5; // rest of a response once it started
+const unsigned long SCHEDULE_FETCH_WAIT_MS = 60000; // watch waiting on a fetch, beyond its spread
+const unsigned long SCHEDULE_WATCH_RETRY_MIN_MS = 5000;   // first retry of an error
+const unsigned long SCHEDULE_WATCH_RETRY_MAX_MS = 300000; // doubles up to 5 minutes
 const int WEB_SERVER_PORT = 80;
+const uint32_t PORTAL_TASK_STACK_SIZE = 6144; // bytes, saving flushes telemetry
+const size_t CONFIG_FORM_SIZE = 128;          // bytes of the posted form
+const uint32_t NETWORK_TASK_STACK_SIZE = 8192; // bytes
+const int NETWORK_TASK_PRIORITY = 1;          // same as the Arduino loop task
+const uint32_t INPUT_TASK_STACK_SIZE = 4096;   // bytes
+const int INPUT_TASK_PRIORITY = 2;             // above the network tasks
+const uint32_t RENDER_TASK_STACK_SIZE = 4096;  // bytes
+const int RENDER_TASK_PRIORITY = 3;            // LED output never waits on others
 
 const int API_MAX_SCHEDULE_SIZE = 96; // elements
 const int API_MIN_TEMP_CONSTRAINT_K = 1800; // Minimum allowed by API
@@ -32,15 +55,86 @@ const int PIN_PIR_SENSOR = 1;
 const int PIN_POTENTIOMETER = 0;
 
 // Hardware configuration
-const int LED_COUNT = 16;
+// 1: LED frames are sent by the SPI peripheral with DMA (non-blocking)
+// 0: bit-banged Adafruit NeoPixel driver, blocks with interrupts disabled
+#define LED_OUTPUT_SPI_DMA 1
+const int LED_COUNT = 16; // whole strip, all zones share the one output
 const int ANALOG_MAX_VALUE = 4095; // ESP32-C3 ADC resolution is 12-bit
 const int PWM_MAX_VALUE = 255;     // Standard 8-bit PWM limit
+constexpr double LED_GAMMA = 2.6;  // Perceived brightness to LED duty
+// Per-channel scale of full white, WS2812 blue and green outshine red
+const int LED_WHITE_BALANCE_R = 255;
+const int LED_WHITE_BALANCE_G = 176;
+const int LED_WHITE_BALANCE_B = 240;
+const int GRADIENT_MIN_PERCENT = 20; // Far end of EFFECT_GRADIENT
+const int DITHER_MAX_COUNT = 32; // LED duty below which frames are dithered
+
+// How a zone spreads its colour over its pixels
+enum ZoneEffect : uint8_t {
+  EFFECT_SOLID,
+  EFFECT_GRADIENT, // Dims towards the last pixel
+  EFFECT_SUNRISE,  // Turning on wipes in from the first pixel
+};
+
+// Zones: pixel ranges of the strip that are lit as separate lights, each
+// switched by its own PIR (zones may share one) and following the schedule of
+// its own API key. A nullptr key shares the device schedule. The button and
+// the potentiometer control every zone.
+struct ZoneConfig {
+  int firstPixel;
+  int pixelCount;
+  int pirPin;
+  const char *apiKey; // registered as a device of its own on the server
+  ZoneEffect effect;
+};
+constexpr ZoneConfig ZONES[] = {
+    {0, LED_COUNT, PIN_PIR_SENSOR, nullptr, EFFECT_SOLID},
+    // e.g. a second room on the same strip:
+    // {0, 8, PIN_PIR_SENSOR, nullptr, EFFECT_SOLID},
+    // {8, 8, 2, "<64 char API key of the second device>", EFFECT_SUNRISE},
+};
+const int ZONE_COUNT = sizeof(ZONES) / sizeof(ZONES[0]);
 
 // Timing configuration
 const unsigned long LOOP_DELAY_MS = 50;   // 20Hz refresh rate
+// 1: idle waits while WiFi is down use light sleep, woken by the timer, PIR,
+//    button or UART. Online the radio uses modem sleep and the CPU idles.
+// 0: idle waits keep the CPU running, e.g. for USB serial debugging
+#define LIGHT_SLEEP_ENABLED 1
+const unsigned long LIGHT_SLEEP_MIN_MS = 5;    // Shorter waits are not worth it
+const unsigned long IDLE_SLEEP_MAX_MS = 1000;  // Light off, longest idle wait
+const unsigned long TRANSITION_FRAME_MS = 10;      // 100Hz while fading
+const unsigned long TRANSITION_DURATION_MS = 400;  // Brightness and colour fades
+const unsigned long OCCUPANCY_SLOT_MS = 100;       // PIR sample window resolution
+const int OCCUPANCY_ARRIVE_SLOTS = 3; // of the last 32, a glitch fills at most two
+const unsigned long OCCUPANCY_TIMEOUT_GROWTH = 10; // +1 s of timeout per 10 s occupied
+const int OCCUPANCY_TIMEOUT_MAX_FACTOR = 3;        // of the schedule's motion timeout
+const unsigned long CONFIG_CUE_MS = 1000; // Red flash when the portal opens
 const unsigned long BUTTON_DEBOUNCE_MS = 200; // 0.2 seconds is enough for a button press
-const unsigned long SCHEDULE_REFRESH_INTERVAL_MS = 3600000; // 1 hour
-const unsigned long TELEMETRY_DEBOUNCE_MS = 2000; // 2 seconds min between sending telemetry events
+const uint32_t INPUT_QUEUE_LENGTH = 32;       // GPIO edges, power of two
+// Schedules are refetched SCHEDULE_REFRESH_LEAD_SEC before valid_until, past
+// the 12 hours the server answers 304, at a point of the jitter window set by
+// the device key. Changes in between are pushed by the watch.
+const long SCHEDULE_REFRESH_LEAD_SEC = 43200;                // 12 hours
+const unsigned long SCHEDULE_REFRESH_JITTER_MS = 3600000;    // 1 hour
+const unsigned long SCHEDULE_REFRESH_MIN_MS = 900000;        // 15 minutes, one point
+const unsigned long SCHEDULE_REFRESH_MAX_MS = 86400000;      // a schedule covers a day
+const unsigned long SCHEDULE_REFRESH_INTERVAL_MS = 21600000; // 6 hours, no valid_until
+const unsigned long SCHEDULE_RETRY_MIN_MS = 5000;            // First retry of a failed fetch
+const unsigned long SCHEDULE_RETRY_MAX_MS = 600000;          // Doubles up to 10 minutes
+// Reconnects, time syncs and pushed changes hit the whole fleet at once, the
+// requests they cause are spread over this window
+const unsigned long FLEET_SPREAD_MS = 30000;
+const unsigned long TELEMETRY_FLUSH_INTERVAL_MS = 60000; // 1 minute max age of a pending batch
+const unsigned long TELEMETRY_FLUSH_JITTER_MS = 15000;   // Up to this much earlier
+const unsigned long TELEMETRY_FLUSH_TIMEOUT_MS = 3000;   // Wait for a flush before reboot
+const unsigned long TELEMETRY_RETRY_MIN_MS = 5000;       // First retry of a failed upload
+const unsigned long TELEMETRY_RETRY_MAX_MS = 300000;     // Doubles up to 5 minutes
+const time_t MIN_VALID_EPOCH_SEC = 1735693200; // January 1, 2025 (Ensures NTP sync)
+const unsigned long HEAP_STATS_INTERVAL_MS = 1000;       // Heap counter sampling
+// 1: stage timings are collected for the `perf` serial command
+#define PERF_STATS_ENABLED 1
+const long TIME_JUMP_TOLERANCE_SEC = 1; // time() only has whole seconds
 const unsigned long TIME_JUMP_REFETCH_THRESHOLD_SEC =
     3600; // 1 hour change triggers schedule refetch
 
@@ -49,7 +143,6 @@ const int MIN_COLOR_TEMP_K = 1000;     // Candlelight/Deep Red
 const int DEFAULT_COLOR_TEMP_K = 3500; // Warm White
 
 // Brightness thresholds (0-100%)
-const int DEFAULT_BRIGHTNESS_LIMIT_PERCENT = 50; // Safety limit for startup
 const int BRIGHTNESS_OFF_THRESHOLD_PERCENT = 10; // Below this, lights turn off
 const int BRIGHTNESS_CHANGE_THRESHOLD_PERCENT = 5; // Hysteresis to prevent flickering
 
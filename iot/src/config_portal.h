@@ -0,0 +1,45 @@
+// Config portal pages, stored in flash and sent as they are
+//
+// CONFIG_PAGE_GZ is portal/config.html gzipped, regenerate it after editing
+// the page with `gzip -9nc portal/config.html | xxd -i` from iot/.
+#ifndef LUMIRUM_CONFIG_PORTAL_H
+#define LUMIRUM_CONFIG_PORTAL_H
+#include "hal.h"
+
+static const uint8_t CONFIG_PAGE_GZ[] PROGMEM = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0x75, 0x51,
+  0xcb, 0x4e, 0xc3, 0x30, 0x10, 0xbc, 0xe7, 0x2b, 0x16, 0x1f, 0x38, 0xd1,
+  0x86, 0x4a, 0x08, 0x10, 0x38, 0x91, 0x50, 0xcb, 0x01, 0x81, 0xd4, 0xa8,
+  0xf4, 0xc2, 0xd1, 0x89, 0xb7, 0xcd, 0x8a, 0xf8, 0x41, 0xb2, 0x4e, 0x5b,
+  0xbe, 0x1e, 0xa7, 0x4d, 0x25, 0x38, 0x70, 0xb0, 0x56, 0xb3, 0x8f, 0xd9,
+  0xd9, 0xb1, 0xbc, 0x58, 0x2c, 0xe7, 0xeb, 0x8f, 0xe2, 0x19, 0x6a, 0x36,
+  0x4d, 0x9e, 0xc8, 0x73, 0x40, 0xa5, 0x63, 0x30, 0xc8, 0x0a, 0xaa, 0x5a,
+  0xb5, 0x1d, 0x72, 0x26, 0x02, 0x6f, 0x26, 0xf7, 0xe2, 0x9c, 0xb6, 0xca,
+  0x60, 0x26, 0x7a, 0xc2, 0x9d, 0x77, 0x2d, 0x0b, 0xa8, 0x9c, 0x65, 0xb4,
+  0xb1, 0x6d, 0x47, 0x9a, 0xeb, 0x4c, 0x63, 0x4f, 0x15, 0x4e, 0x8e, 0xe0,
+  0x0a, 0xc8, 0x12, 0x93, 0x6a, 0x26, 0x5d, 0xa5, 0x1a, 0xcc, 0x66, 0x03,
+  0x09, 0x13, 0x37, 0x98, 0xbf, 0x05, 0x43, 0xab, 0x60, 0x60, 0x71, 0x6c,
+  0x87, 0xb9, 0xb3, 0x1b, 0xda, 0xca, 0xf4, 0x54, 0x4c, 0x64, 0x3a, 0x0a,
+  0x29, 0x9d, 0x3e, 0x0c, 0xb2, 0x66, 0xff, 0x0d, 0xc4, 0x4a, 0x22, 0x7d,
+  0x3e, 0x66, 0xa9, 0x83, 0x60, 0x55, 0xe0, 0xda, 0xb5, 0xf4, 0x8d, 0x7a,
+  0x0a, 0x45, 0x83, 0xaa, 0x43, 0x08, 0x5e, 0x2b, 0x46, 0x78, 0x2a, 0x5e,
+  0xe0, 0x15, 0x0f, 0x53, 0x99, 0xfa, 0x38, 0xb5, 0x71, 0xad, 0x01, 0x55,
+  0x31, 0x39, 0x9b, 0x89, 0xb4, 0x53, 0x3d, 0x0a, 0x88, 0x17, 0xd6, 0x4e,
+  0x67, 0xa2, 0x58, 0xbe, 0xaf, 0xa3, 0xd8, 0x71, 0xe0, 0x01, 0x24, 0x59,
+  0x1f, 0x18, 0xf8, 0xe0, 0xe3, 0xed, 0x8c, 0xfb, 0x78, 0xf7, 0xc9, 0x07,
+  0xe5, 0xe9, 0x13, 0x0f, 0x02, 0xba, 0xb8, 0x2f, 0x13, 0x77, 0xd7, 0x91,
+  0x82, 0x6c, 0x83, 0x76, 0x1b, 0xad, 0x10, 0xb7, 0x37, 0x11, 0xaa, 0xfd,
+  0x6f, 0xd8, 0xe2, 0x57, 0xa0, 0x16, 0x75, 0x2e, 0xcb, 0xf6, 0xf8, 0x92,
+  0x3f, 0xd4, 0x5d, 0x28, 0x0d, 0x45, 0xf2, 0x5e, 0x35, 0x21, 0xc2, 0xf7,
+  0x28, 0x0a, 0x2e, 0x95, 0xf1, 0x8f, 0xb0, 0xc2, 0xd2, 0x39, 0x1e, 0x0c,
+  0x4c, 0x07, 0xe1, 0x43, 0x1c, 0xcd, 0x49, 0x4f, 0x7f, 0xf7, 0x03, 0x1e,
+  0x25, 0x3f, 0xab, 0xd3, 0x01, 0x00, 0x00
+};
+
+// Too short to gain from compression
+static const char CONFIG_SAVED_HTML[] PROGMEM =
+    "<body>Saved! Rebooting...</body>";
+static const char CONFIG_INVALID_KEY_HTML[] PROGMEM =
+    "<body>Invalid Key Length</body>";
+
+#endif // LUMIRUM_CONFIG_PORTAL_H
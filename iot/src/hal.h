@@ -0,0 +1,26 @@
+// Hardware abstraction for the code shared with the native build
+//
+// On the device this is the Arduino core. [env:native] compiles the lighting
+// core and bench/ against the C++ standard library instead, so only what
+// that code uses from Arduino.h is provided for it.
+#ifndef LUMIRUM_HAL_H
+#define LUMIRUM_HAL_H
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#else
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+using std::max;
+using std::min;
+
+#define constrain(amt, low, high)                                              \
+  ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#endif
+
+#endif // LUMIRUM_HAL_H
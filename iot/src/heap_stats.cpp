@@ -0,0 +1,70 @@
+// Heap usage counters
+//
+// Steady state should not allocate, so once the device has settled the free
+// heap and its largest block stay put. Fragmentation is the share of free
+// memory that is not in the largest block, it only grows when allocations
+// of different lifetimes interleave.
+
+#include "heap_stats.h"
+
+static unsigned long lastSampleMs = 0;
+static bool sampled = false;
+static uint32_t baselineFree = 0;  // Free heap at the last reset
+static uint32_t lowestFree = 0;    // Since the last reset
+static uint32_t lowestLargest = 0; // Largest free block, since the last reset
+static int worstFragmentation = 0; // Percent, since the last reset
+
+static int fragmentationPercent(uint32_t freeBytes, uint32_t largest) {
+  return freeBytes == 0 ? 0 : 100 - (int)((uint64_t)largest * 100 / freeBytes);
+}
+
+void heapStatsReset() {
+  baselineFree = ESP.getFreeHeap();
+  lowestFree = baselineFree;
+  lowestLargest = ESP.getMaxAllocHeap();
+  worstFragmentation = fragmentationPercent(baselineFree, lowestLargest);
+  lastSampleMs = millis();
+  sampled = true;
+}
+
+void heapStatsSample(unsigned long nowMs) {
+  if (!sampled) {
+    heapStatsReset();
+    return;
+  }
+  if (nowMs - lastSampleMs < HEAP_STATS_INTERVAL_MS)
+    return;
+  lastSampleMs = nowMs;
+
+  uint32_t freeBytes = ESP.getFreeHeap();
+  uint32_t largest = ESP.getMaxAllocHeap(); // Walks the heap, hence the interval
+  lowestFree = std::min(lowestFree, freeBytes);
+  lowestLargest = std::min(lowestLargest, largest);
+  worstFragmentation =
+      std::max(worstFragmentation, fragmentationPercent(freeBytes, largest));
+}
+
+void heapStatsPrint() {
+  uint32_t freeBytes = ESP.getFreeHeap();
+  uint32_t largest = ESP.getMaxAllocHeap();
+
+  Serial.println("\nHEAP");
+  Serial.print("Free:              ");
+  Serial.print(freeBytes);
+  Serial.print(" bytes (");
+  Serial.print((long)freeBytes - (long)baselineFree);
+  Serial.println(" since reset)");
+  Serial.print("Lowest free:       ");
+  Serial.print(lowestFree);
+  Serial.print(" bytes, since boot ");
+  Serial.println(ESP.getMinFreeHeap());
+  Serial.print("Largest block:     ");
+  Serial.print(largest);
+  Serial.print(" bytes, lowest ");
+  Serial.println(lowestLargest);
+  Serial.print("Fragmentation:     ");
+  Serial.print(fragmentationPercent(freeBytes, largest));
+  Serial.print("%, worst ");
+  Serial.print(worstFragmentation);
+  Serial.println("%");
+}
@@ -0,0 +1,14 @@
+// Heap usage counters
+#ifndef LUMIRUM_HEAP_STATS_H
+#define LUMIRUM_HEAP_STATS_H
+#include "config.h"
+
+// Samples the heap at most every HEAP_STATS_INTERVAL_MS, cheap to call often
+void heapStatsSample(unsigned long nowMs);
+
+// Restarts the low-water marks, e.g. once the device has settled after boot
+void heapStatsReset();
+
+void heapStatsPrint();
+
+#endif // LUMIRUM_HEAP_STATS_H
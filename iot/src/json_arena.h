@@ -0,0 +1,92 @@
+// Fixed-capacity ArduinoJson allocator
+//
+// JsonDocument allocates its pools and copied strings on the heap. Giving
+// it a JsonArena instead keeps them in a static buffer: blocks are bumped
+// off the front, only the newest one can be resized or given back in place,
+// and reset() drops everything at once when no document uses the arena.
+#ifndef LUMIRUM_JSON_ARENA_H
+#define LUMIRUM_JSON_ARENA_H
+#include <ArduinoJson.h>
+
+template <size_t Capacity> class JsonArena : public ArduinoJson::Allocator {
+public:
+  void *allocate(size_t size) override {
+    size_t block = BLOCK_HEADER_SIZE + align(size);
+    if (block > Capacity - used) {
+      ++failures;
+      return nullptr;
+    }
+
+    uint8_t *start = storage + used;
+    *reinterpret_cast<size_t *>(start) = size;
+    newest = used;
+    used += block;
+    peak = std::max(peak, used);
+    return start + BLOCK_HEADER_SIZE;
+  }
+
+  void deallocate(void *pointer) override {
+    if (pointer != nullptr && isNewest(pointer)) {
+      used = newest;
+      newest = NO_BLOCK;
+    }
+  }
+
+  void *reallocate(void *pointer, size_t size) override {
+    if (pointer == nullptr)
+      return allocate(size);
+
+    if (isNewest(pointer)) {
+      size_t end = newest + BLOCK_HEADER_SIZE + align(size);
+      if (end > Capacity) {
+        ++failures;
+        return nullptr;
+      }
+      *reinterpret_cast<size_t *>(storage + newest) = size;
+      used = end;
+      peak = std::max(peak, used);
+      return pointer;
+    }
+
+    size_t oldSize = *reinterpret_cast<size_t *>(static_cast<uint8_t *>(pointer) -
+                                                 BLOCK_HEADER_SIZE);
+    if (size <= oldSize)
+      return pointer; // Shrinking in the middle, the tail is wasted until reset()
+
+    void *moved = allocate(size);
+    if (moved != nullptr)
+      memcpy(moved, pointer, oldSize);
+    return moved;
+  }
+
+  // Only while no JsonDocument holds memory from the arena
+  void reset() {
+    used = 0;
+    newest = NO_BLOCK;
+  }
+
+  size_t peakUsage() const { return peak; }
+  uint32_t failedAllocations() const { return failures; }
+
+private:
+  static constexpr size_t ALIGNMENT = 8;
+  static constexpr size_t BLOCK_HEADER_SIZE = ALIGNMENT; // size_t, padded
+  static constexpr size_t NO_BLOCK = SIZE_MAX;
+
+  static constexpr size_t align(size_t size) {
+    return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+  }
+
+  bool isNewest(void *pointer) const {
+    return newest != NO_BLOCK &&
+           pointer == storage + newest + BLOCK_HEADER_SIZE;
+  }
+
+  alignas(ALIGNMENT) uint8_t storage[Capacity];
+  size_t used = 0;
+  size_t newest = NO_BLOCK; // Offset of the most recent block
+  size_t peak = 0;
+  uint32_t failures = 0;
+};
+
+#endif // LUMIRUM_JSON_ARENA_H
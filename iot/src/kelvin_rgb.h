@@ -0,0 +1,115 @@
+// Kelvin to RGB lookup table generated at compile time
+#ifndef LUMIRUM_KELVIN_RGB_H
+#define LUMIRUM_KELVIN_RGB_H
+#include "config.h"
+#include <array>
+
+const int KELVIN_TABLE_STEP_K = 10;
+const int KELVIN_TABLE_MAX_K = 10000; // Maximum allowed by API
+const int KELVIN_TABLE_SIZE =
+    (KELVIN_TABLE_MAX_K - MIN_COLOR_TEMP_K) / KELVIN_TABLE_STEP_K + 1;
+
+struct KelvinRgb {
+  uint8_t r, g, b;
+};
+
+namespace kelvin_detail {
+
+// libm is not constexpr, these series are only ever evaluated by the compiler
+
+constexpr double LN_2 = 0.6931471805599453;
+
+constexpr double log(double x) {
+  int exponent = 0;
+  while (x >= 2.0) {
+    x /= 2.0;
+    ++exponent;
+  }
+  while (x < 1.0) {
+    x *= 2.0;
+    --exponent;
+  }
+
+  // ln(x) = 2 * atanh((x - 1) / (x + 1)), converges fast for x in [1, 2)
+  double z = (x - 1.0) / (x + 1.0);
+  double term = z;
+  double sum = 0.0;
+  for (int n = 1; n < 60; n += 2) {
+    sum += term / n;
+    term *= z * z;
+  }
+  return 2.0 * sum + exponent * LN_2;
+}
+
+constexpr double exp(double x) {
+  // Halve until the Taylor series converges quickly, then square back
+  int halvings = 0;
+  while (x > 0.5 || x < -0.5) {
+    x /= 2.0;
+    ++halvings;
+  }
+
+  double term = 1.0;
+  double sum = 1.0;
+  for (int n = 1; n < 30; ++n) {
+    term *= x / n;
+    sum += term;
+  }
+  for (int i = 0; i < halvings; ++i)
+    sum *= sum;
+  return sum;
+}
+
+constexpr double pow(double base, double exponent) {
+  return exp(exponent * log(base));
+}
+
+constexpr uint8_t clampChannel(double value) {
+  return value < 0 ? 0 : value > 255 ? 255 : (uint8_t)value;
+}
+
+// Tanner Helland's Algorithm for RGB from Kelvin
+// https://tannerhelland.com/2012/09/18/convert-temperature-rgb-algorithm-code.html
+constexpr KelvinRgb fromKelvin(int kelvin) {
+  double temp = kelvin / 100.0;
+  KelvinRgb rgb = {255, 255, 255};
+
+  if (temp > 66) {
+    rgb.r = clampChannel(329.698727446 * pow(temp - 60, -0.1332047592));
+    rgb.g = clampChannel(288.1221695283 * pow(temp - 60, -0.0755148492));
+  } else {
+    rgb.g = clampChannel(99.4708025861 * log(temp) - 161.1195681661);
+  }
+
+  if (temp <= 19) {
+    rgb.b = 0;
+  } else if (temp < 66) {
+    rgb.b = clampChannel(138.5177312231 * log(temp - 10) - 305.0447927307);
+  }
+
+  return rgb;
+}
+
+constexpr std::array<KelvinRgb, KELVIN_TABLE_SIZE> buildTable() {
+  std::array<KelvinRgb, KELVIN_TABLE_SIZE> table = {};
+  for (int i = 0; i < KELVIN_TABLE_SIZE; ++i)
+    table[i] = fromKelvin(MIN_COLOR_TEMP_K + i * KELVIN_TABLE_STEP_K);
+  return table;
+}
+
+} // namespace kelvin_detail
+
+// Every KELVIN_TABLE_STEP_K from MIN_COLOR_TEMP_K, ends up in flash (.rodata)
+constexpr std::array<KelvinRgb, KELVIN_TABLE_SIZE> KELVIN_RGB_TABLE =
+    kelvin_detail::buildTable();
+
+// The formula switches branches at 6600 K and jumps by up to 4 counts there.
+// Between the neighbouring entries it is interpolated to these instead, which
+// keeps every kelvin within 1 count (the rounding) of the formula.
+const int KELVIN_BRANCH_K = 6600;
+static_assert((KELVIN_BRANCH_K - MIN_COLOR_TEMP_K) % KELVIN_TABLE_STEP_K == 0,
+              "the branch switch must be a table entry");
+constexpr KelvinRgb KELVIN_BELOW_BRANCH = kelvin_detail::fromKelvin(KELVIN_BRANCH_K - 1);
+constexpr KelvinRgb KELVIN_ABOVE_BRANCH = kelvin_detail::fromKelvin(KELVIN_BRANCH_K + 1);
+
+#endif // LUMIRUM_KELVIN_RGB_H
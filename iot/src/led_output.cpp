@@ -0,0 +1,154 @@
+// LED strip output backend
+//
+// With LED_OUTPUT_SPI_DMA every WS2812 bit is encoded as 3 SPI bits (0 =
+// 100, 1 = 110) at 2.4 MHz and clocked out on MOSI by the SPI peripheral with
+// DMA. The ESP32-C3 RMT has no DMA and needs refill interrupts, SPI does not.
+// Two encoded buffers are used in turns, so show() only waits when two
+// frames are already queued.
+
+#include "led_output.h"
+#include <array>
+
+static uint8_t pixels[LED_COUNT * 3]; // GRB, wire order
+
+void ledOutputSetPixel(int index, uint8_t r, uint8_t g, uint8_t b) {
+  if (index < 0 || index >= LED_COUNT)
+    return;
+
+  pixels[index * 3] = g;
+  pixels[index * 3 + 1] = r;
+  pixels[index * 3 + 2] = b;
+}
+
+void ledOutputFill(uint8_t r, uint8_t g, uint8_t b) {
+  for (int i = 0; i < LED_COUNT; ++i)
+    ledOutputSetPixel(i, r, g, b);
+}
+
+void ledOutputClear() { memset(pixels, 0, sizeof(pixels)); }
+
+#if LED_OUTPUT_SPI_DMA
+
+#include <driver/spi_master.h>
+#include <esp_heap_caps.h>
+
+const int LED_SPI_CLOCK_HZ = 2400000; // 3 SPI bits per 1.25 us WS2812 bit
+const int LED_SPI_BYTES_PER_CHANNEL = 3;
+const int LED_SPI_RESET_BYTES = 100; // >280 us low latches the frame
+const size_t LED_SPI_FRAME_SIZE =
+    sizeof(pixels) * LED_SPI_BYTES_PER_CHANNEL + LED_SPI_RESET_BYTES;
+
+// SPI bit pattern of every channel value, MSB first
+constexpr std::array<uint32_t, 256> buildSpiPatterns() {
+  std::array<uint32_t, 256> patterns = {};
+  for (int value = 0; value < 256; ++value) {
+    uint32_t pattern = 0;
+    for (int bit = 7; bit >= 0; --bit)
+      pattern = (pattern << 3) | ((value >> bit) & 1 ? 0b110 : 0b100);
+    patterns[value] = pattern;
+  }
+  return patterns;
+}
+constexpr std::array<uint32_t, 256> SPI_PATTERNS = buildSpiPatterns();
+
+struct FrameBuffer {
+  uint8_t *data = nullptr; // DMA capable, LED_SPI_FRAME_SIZE bytes
+  spi_transaction_t transaction = {};
+  bool inFlight = false;
+};
+
+static spi_device_handle_t spiDevice = nullptr;
+static FrameBuffer frames[2];
+static int nextFrame = 0;
+
+// Marks finished transmissions, waits for one only if `wait` is set
+static void reclaimFrames(bool wait) {
+  spi_transaction_t *done;
+  TickType_t timeout = wait ? portMAX_DELAY : 0;
+
+  while (spi_device_get_trans_result(spiDevice, &done, timeout) == ESP_OK) {
+    static_cast<FrameBuffer *>(done->user)->inFlight = false;
+    timeout = 0;
+  }
+}
+
+void ledOutputBegin() {
+  for (FrameBuffer &frame : frames) {
+    frame.data = (uint8_t *)heap_caps_malloc(LED_SPI_FRAME_SIZE, MALLOC_CAP_DMA);
+    if (frame.data == nullptr) {
+      Serial.println("[ERROR] Could not allocate LED DMA buffers");
+      return;
+    }
+    memset(frame.data, 0, LED_SPI_FRAME_SIZE);
+    frame.transaction.length = LED_SPI_FRAME_SIZE * 8; // bits
+    frame.transaction.tx_buffer = frame.data;
+    frame.transaction.user = &frame;
+  }
+
+  spi_bus_config_t bus = {};
+  bus.mosi_io_num = PIN_LED_RING;
+  bus.miso_io_num = -1;
+  bus.sclk_io_num = -1;
+  bus.quadwp_io_num = -1;
+  bus.quadhd_io_num = -1;
+  bus.max_transfer_sz = LED_SPI_FRAME_SIZE;
+
+  spi_device_interface_config_t device = {};
+  device.mode = 0;
+  device.clock_speed_hz = LED_SPI_CLOCK_HZ;
+  device.spics_io_num = -1;
+  device.queue_size = 2;
+
+  esp_err_t error = spi_bus_initialize(SPI2_HOST, &bus, SPI_DMA_CH_AUTO);
+  if (error == ESP_OK)
+    error = spi_bus_add_device(SPI2_HOST, &device, &spiDevice);
+
+  if (error != ESP_OK) {
+    Serial.print("[ERROR] LED SPI init failed: ");
+    Serial.println(esp_err_to_name(error));
+    spiDevice = nullptr;
+  }
+}
+
+void ledOutputShow() {
+  if (spiDevice == nullptr)
+    return;
+
+  reclaimFrames(false);
+
+  FrameBuffer &frame = frames[nextFrame];
+  if (frame.inFlight)
+    reclaimFrames(true); // both frames queued, the oldest one is this
+
+  uint8_t *out = frame.data;
+  for (uint8_t channel : pixels) {
+    uint32_t pattern = SPI_PATTERNS[channel];
+    *out++ = pattern >> 16;
+    *out++ = pattern >> 8;
+    *out++ = pattern;
+  }
+  // The reset bytes at the end stay zero
+
+  if (spi_device_queue_trans(spiDevice, &frame.transaction, portMAX_DELAY) ==
+      ESP_OK) {
+    frame.inFlight = true;
+    nextFrame ^= 1;
+  }
+}
+
+#else
+
+#include <Adafruit_NeoPixel.h>
+
+static Adafruit_NeoPixel strip(LED_COUNT, PIN_LED_RING, NEO_GRB + NEO_KHZ800);
+
+void ledOutputBegin() { strip.begin(); }
+
+// Bit-banged, blocks with interrupts disabled for the whole frame
+void ledOutputShow() {
+  for (int i = 0; i < LED_COUNT; ++i)
+    strip.setPixelColor(i, pixels[i * 3 + 1], pixels[i * 3], pixels[i * 3 + 2]);
+  strip.show();
+}
+
+#endif
@@ -0,0 +1,15 @@
+// LED strip output backend
+#ifndef LUMIRUM_LED_OUTPUT_H
+#define LUMIRUM_LED_OUTPUT_H
+#include "config.h"
+
+void ledOutputBegin();
+void ledOutputSetPixel(int index, uint8_t r, uint8_t g, uint8_t b);
+void ledOutputFill(uint8_t r, uint8_t g, uint8_t b);
+void ledOutputClear();
+
+// Hands the frame to the hardware and returns, with LED_OUTPUT_SPI_DMA the
+// next frame can be prepared while this one is still being transmitted
+void ledOutputShow();
+
+#endif // LUMIRUM_LED_OUTPUT_H
@@ -0,0 +1,311 @@
+// Lighting core: schedule lookups, colour conversion, the per-pixel render
+// pipeline and the occupancy filter
+
+#include "lighting.h"
+#include "color_correction.h"
+#include "kelvin_rgb.h"
+
+// Sort the points by time of day and expand them into one entry per minute,
+// so the hot path is an array index
+void indexSchedule(LightingSchedule &target) {
+  int count = 0;
+  for (int i = 0; i < target.pointCount; ++i) {
+    target.dayPoints[count].daySeconds =
+        target.points[i].timestamp % SECONDS_PER_DAY;
+    target.dayPoints[count].colorTemp = target.points[i].colorTemp;
+    ++count;
+  }
+
+  // Insertion sort, stable and in place: std::stable_sort takes a heap
+  // buffer, and the server sends the points in time order, so a day only
+  // needs the points after midnight moved to the front
+  for (int i = 1; i < count; ++i) {
+    LightingSchedule::DayPoint point = target.dayPoints[i];
+    int j = i;
+    for (; j > 0 && target.dayPoints[j - 1].daySeconds > point.daySeconds; --j)
+      target.dayPoints[j] = target.dayPoints[j - 1];
+    target.dayPoints[j] = point;
+  }
+
+  // A schedule longer than a day repeats times of day, keep the earliest point
+  auto last = std::unique(target.dayPoints, target.dayPoints + count,
+                          [](const LightingSchedule::DayPoint &a,
+                             const LightingSchedule::DayPoint &b) {
+                            return a.daySeconds == b.daySeconds;
+                          });
+
+  target.dayPointCount = last - target.dayPoints;
+  target.lastSegment = 0;
+  target.nightUntil = 0; // The window may have changed
+
+  // In order, so findDaySegment() mostly hits its cached segment
+  for (int minute = 0; minute < MINUTES_PER_DAY; ++minute)
+    target.minuteColorTemp[minute] =
+        target.dayPointCount > 0 ? interpolateColorTemp(target, minute * 60)
+                                 : DEFAULT_COLOR_TEMP_K;
+}
+
+// Index of the point starting the segment that contains daySeconds, only
+// used to build minuteColorTemp
+int findDaySegment(LightingSchedule &schedule, uint32_t daySeconds) {
+  const LightingSchedule::DayPoint *points = schedule.dayPoints;
+  int count = schedule.dayPointCount;
+
+  // Lookups come in time order, so check the cached and the following segment
+  for (int step = 0; step < 2; ++step) {
+    int segment = (schedule.lastSegment + step) % count;
+    uint32_t start = points[segment].daySeconds;
+    uint32_t end = segment + 1 < count ? points[segment + 1].daySeconds
+                                       : points[0].daySeconds + SECONDS_PER_DAY;
+
+    if ((daySeconds >= start && daySeconds < end) ||
+        (daySeconds + SECONDS_PER_DAY >= start &&
+         daySeconds + SECONDS_PER_DAY < end)) {
+      schedule.lastSegment = segment;
+      return segment;
+    }
+  }
+
+  // Binary search for the first lookup
+  const LightingSchedule::DayPoint *upper = std::upper_bound(
+      points, points + count, daySeconds,
+      [](uint32_t value, const LightingSchedule::DayPoint &point) {
+        return value < point.daySeconds;
+      });
+
+  int segment = upper == points ? count - 1 : (upper - points) - 1;
+  schedule.lastSegment = segment;
+  return segment;
+}
+
+int interpolateColorTemp(LightingSchedule &schedule, uint32_t daySeconds) {
+  int segment = findDaySegment(schedule, daySeconds);
+  int next = (segment + 1) % schedule.dayPointCount;
+
+  // The last segment wraps past midnight to the first point
+  uint32_t start = schedule.dayPoints[segment].daySeconds;
+  uint32_t end = schedule.dayPoints[next].daySeconds;
+  if (end <= start)
+    end += SECONDS_PER_DAY;
+  if (daySeconds < start)
+    daySeconds += SECONDS_PER_DAY;
+
+  // Linear interpolation in integer math, no FPU on the C3
+  int temp1 = schedule.dayPoints[segment].colorTemp;
+  int temp2 = schedule.dayPoints[next].colorTemp;
+
+  return temp1 + (int32_t)(temp2 - temp1) * (int32_t)(daySeconds - start) /
+                     (int32_t)(end - start);
+}
+
+int scheduleColorTemp(LightingSchedule &schedule, time_t now) {
+  if (schedule.dayPointCount == 0)
+    return DEFAULT_COLOR_TEMP_K;
+
+  // A stored schedule can be loaded before NTP, the time of day is unknown yet
+  if (now < MIN_VALID_EPOCH_SEC)
+    return DEFAULT_COLOR_TEMP_K;
+
+  if (schedule.nightModeEnabled && scheduleIsNight(schedule, now))
+    return MIN_COLOR_TEMP_K;
+
+  // Cyclic lookup by time of day
+  return schedule.minuteColorTemp[now % SECONDS_PER_DAY / 60];
+}
+
+bool isNightTime(const LightingSchedule &schedule, uint32_t secondsSinceMidnight) {
+  if (schedule.sleepStartUtcSeconds <= schedule.sleepEndUtcSeconds) {
+    // e.g. 2:00 - 10:00 a.m.
+    return secondsSinceMidnight >= schedule.sleepStartUtcSeconds &&
+           secondsSinceMidnight < schedule.sleepEndUtcSeconds;
+  } else {
+    // e.g. 20:00 - 6:00
+    return secondsSinceMidnight >= schedule.sleepStartUtcSeconds ||
+           secondsSinceMidnight < schedule.sleepEndUtcSeconds;
+  }
+}
+
+uint32_t secondsToNightBoundary(const LightingSchedule &schedule,
+                                uint32_t daySeconds) {
+  auto until = [daySeconds](uint32_t boundary) {
+    uint32_t seconds =
+        (boundary % SECONDS_PER_DAY + SECONDS_PER_DAY - daySeconds) % SECONDS_PER_DAY;
+    return seconds == 0 ? SECONDS_PER_DAY : seconds;
+  };
+  return min(until(schedule.sleepStartUtcSeconds),
+             until(schedule.sleepEndUtcSeconds));
+}
+
+bool scheduleIsNight(LightingSchedule &schedule, time_t now) {
+  // Also recomputed when the clock went back past the last check
+  if (now >= schedule.nightCheckedAt && now < schedule.nightUntil)
+    return schedule.night;
+
+  uint32_t daySeconds = now % SECONDS_PER_DAY;
+  schedule.night = isNightTime(schedule, daySeconds);
+  schedule.nightCheckedAt = now;
+  schedule.nightUntil = now + secondsToNightBoundary(schedule, daySeconds);
+  return schedule.night;
+}
+
+void timeBaseTick(TimeBase &base, time_t wallNow, unsigned long nowMs) {
+  // Both clocks advance by the same amount unless the wall clock was set.
+  // One second of slack for the resolution of time().
+  if (base.tickMs != 0 || base.now != 0) {
+    long expected = (long)((nowMs - base.tickMs) / 1000);
+    long shift = (long)(wallNow - base.now) - expected;
+    base.jumpSeconds = shift > TIME_JUMP_TOLERANCE_SEC ||
+                               shift < -TIME_JUMP_TOLERANCE_SEC
+                           ? shift
+                           : 0;
+  }
+
+  base.now = wallNow;
+  base.daySeconds = wallNow % SECONDS_PER_DAY;
+  base.synced = wallNow >= MIN_VALID_EPOCH_SEC;
+  base.tickMs = nowMs;
+}
+
+// Table lookup with linear interpolation in integer math, the soft-float
+// formula is evaluated at compile time in kelvin_rgb.h
+void convertColorTempToRGB(int kelvin, uint8_t *r, uint8_t *g, uint8_t *b) {
+  kelvin = constrain(kelvin, MIN_COLOR_TEMP_K, KELVIN_TABLE_MAX_K);
+
+  int offset = kelvin - MIN_COLOR_TEMP_K;
+  int index = offset / KELVIN_TABLE_STEP_K;
+  int fraction = offset % KELVIN_TABLE_STEP_K;
+
+  const KelvinRgb *low = &KELVIN_RGB_TABLE[index];
+  const KelvinRgb *high = &KELVIN_RGB_TABLE[min(index + 1, KELVIN_TABLE_SIZE - 1)];
+  int span = KELVIN_TABLE_STEP_K;
+
+  // Not across the jump of the formula, only up to either side of it
+  if (kelvin > KELVIN_BRANCH_K - KELVIN_TABLE_STEP_K && kelvin < KELVIN_BRANCH_K) {
+    high = &KELVIN_BELOW_BRANCH;
+    span = KELVIN_TABLE_STEP_K - 1;
+  } else if (kelvin > KELVIN_BRANCH_K && kelvin < KELVIN_BRANCH_K + KELVIN_TABLE_STEP_K) {
+    low = &KELVIN_ABOVE_BRANCH;
+    fraction -= 1;
+    span = KELVIN_TABLE_STEP_K - 1;
+  }
+
+  *r = low->r + (high->r - low->r) * fraction / span;
+  *g = low->g + (high->g - low->g) * fraction / span;
+  *b = low->b + (high->b - low->b) * fraction / span;
+}
+
+// value * scale / 255, rounded down except that full scale keeps value as is
+static inline uint8_t scale8(uint8_t value, int scale) {
+  return (value * (scale + 1)) >> 8;
+}
+
+// Whole LED counts of `duty` in 1/256 counts. Dim channels are rounded at
+// `threshold` so they average out over the frames, brighter ones are rounded
+// to the nearest count.
+static inline uint8_t ditherChannel(uint32_t duty, uint8_t threshold,
+                                    bool &dithered) {
+  if (duty >= (uint32_t)DITHER_MAX_COUNT << 8)
+    return (duty + 128) >> 8;
+  dithered |= (duty & 0xFF) != 0;
+  return (duty + threshold) >> 8;
+}
+
+bool renderZonePixels(ZoneEffect effect, int kelvin, int brightness, int wipe,
+                      uint8_t frame, PixelColor *pixels, int count) {
+  uint8_t r = 0, g = 0, b = 0;
+  brightness = constrain(brightness, 0, PWM_MAX_VALUE);
+  if (brightness > 0)
+    convertColorTempToRGB(kelvin, &r, &g, &b);
+  uint32_t dutyR = CHANNEL_R[r], dutyG = CHANNEL_G[g], dutyB = CHANNEL_B[b];
+
+  // Level of the pixel in 8.8 fixed point, stepped instead of divided
+  int32_t level = brightness << 8;
+  int32_t step = 0;
+  if (effect == EFFECT_GRADIENT && count > 1)
+    step = ((brightness * (100 - GRADIENT_MIN_PERCENT) / 100) << 8) / (count - 1);
+
+  // The wipe front moves count + 1 pixels, a pixel fades in over the last one
+  int32_t front = constrain(wipe, 0, 255) * (count + 1);
+
+  bool dithered = false;
+  for (int i = 0; i < count; ++i) {
+    int pixelLevel = level >> 8;
+    if (effect == EFFECT_SUNRISE)
+      pixelLevel = scale8(pixelLevel, constrain(front - i * 255, 0, 255));
+
+    // Scaled in linear light, the full level keeps the duty as is.
+    // Neighbouring pixels are a phase apart, so they do not blink together.
+    uint32_t linear = GAMMA_TABLE[pixelLevel] + 1;
+    uint8_t threshold = DITHER_THRESHOLDS[(frame + i) % DITHER_PHASES];
+    pixels[i].r = ditherChannel(dutyR * linear >> 16, threshold, dithered);
+    pixels[i].g = ditherChannel(dutyG * linear >> 16, threshold, dithered);
+    pixels[i].b = ditherChannel(dutyB * linear >> 16, threshold, dithered);
+    level -= step;
+  }
+  return dithered;
+}
+
+void occupancySample(OccupancyFilter &filter, bool motion, unsigned long nowMs) {
+  // An edge can be stamped slightly before the last sample
+  if ((long)(nowMs - filter.lastSampleMs) < 0)
+    nowMs = filter.lastSampleMs;
+
+  unsigned long shift =
+      nowMs / OCCUPANCY_SLOT_MS - filter.lastSampleMs / OCCUPANCY_SLOT_MS;
+  if (shift > 0) {
+    // A high level was held through every slot since the last sample
+    uint32_t held = !filter.motion                      ? 0
+                    : shift >= OCCUPANCY_WINDOW_SLOTS ? UINT32_MAX
+                                                      : (1u << shift) - 1;
+    filter.window =
+        (shift >= OCCUPANCY_WINDOW_SLOTS ? 0 : filter.window << shift) | held;
+  }
+
+  if (motion)
+    filter.window |= 1;
+  // Past the same threshold as an arrival, so a glitch in an occupied room
+  // does not hold the light on either
+  if ((motion || filter.motion) &&
+      occupancyConfidence(filter) >= OCCUPANCY_ARRIVE_SLOTS)
+    filter.lastMotionMs = nowMs;
+  filter.motion = motion;
+  filter.lastSampleMs = nowMs;
+}
+
+OccupancyEvent occupancyUpdate(OccupancyFilter &filter, bool motion,
+                               unsigned long nowMs, unsigned long baseTimeoutMs) {
+  occupancySample(filter, motion, nowMs);
+
+  if (!filter.occupied) {
+    if (occupancyConfidence(filter) < OCCUPANCY_ARRIVE_SLOTS)
+      return OCCUPANCY_NONE;
+    filter.occupied = true;
+    filter.occupiedSinceMs = filter.lastSampleMs;
+    return OCCUPANCY_ARRIVED;
+  }
+
+  if (filter.motion ||
+      filter.lastSampleMs - filter.lastMotionMs <=
+          occupancyTimeoutMs(filter, baseTimeoutMs))
+    return OCCUPANCY_NONE;
+
+  occupancyClear(filter);
+  return OCCUPANCY_LEFT;
+}
+
+unsigned long occupancyTimeoutMs(const OccupancyFilter &filter,
+                                 unsigned long baseTimeoutMs) {
+  if (!filter.occupied)
+    return baseTimeoutMs;
+
+  // Only up to the last motion, so the deadline does not move while waiting
+  unsigned long growth =
+      (filter.lastMotionMs - filter.occupiedSinceMs) / OCCUPANCY_TIMEOUT_GROWTH;
+  return baseTimeoutMs +
+         min(growth, baseTimeoutMs * (OCCUPANCY_TIMEOUT_MAX_FACTOR - 1));
+}
+
+void occupancyClear(OccupancyFilter &filter) {
+  filter.occupied = false;
+  filter.window = 0; // Older motion must not bring it right back
+}
@@ -0,0 +1,137 @@
+// Lighting core: schedule lookups, colour conversion, the per-pixel render
+// pipeline and the occupancy filter
+//
+// Only depends on hal.h, so it builds for the device and for [env:native],
+// where bench/ replays recorded schedules and sensor traces through it.
+#ifndef LUMIRUM_LIGHTING_H
+#define LUMIRUM_LIGHTING_H
+#include "config.h"
+
+const uint32_t SECONDS_PER_DAY = 86400;
+const int MINUTES_PER_DAY = 1440;
+const size_t SCHEDULE_ETAG_SIZE = 64; // "<profile>-<unix time>-<hash>"
+
+struct LightingSchedule {
+  long profileId = 0;
+  uint32_t sleepStartUtcSeconds = 0;
+  uint32_t sleepEndUtcSeconds = 0;
+  int minColorTemp = DEFAULT_COLOR_TEMP_K;
+  int maxColorTemp = 6500; // a sane default
+  bool nightModeEnabled = false;
+  int motionTimeoutSeconds = 300; // 5 minutes
+  time_t generatedAt = 0;
+  time_t validUntil = 0;
+
+  struct Point {
+    time_t timestamp;
+    int colorTemp;
+  };
+  Point points[API_MAX_SCHEDULE_SIZE];
+  int pointCount = 0;
+
+  // Points sorted by UTC time of day, built once per load by indexSchedule()
+  struct DayPoint {
+    uint32_t daySeconds;
+    int colorTemp;
+  };
+  DayPoint dayPoints[API_MAX_SCHEDULE_SIZE];
+  int dayPointCount = 0;
+  int lastSegment = 0; // Segment of the previous lookup, usually still valid
+
+  // The curve at the start of every UTC minute, what lookups read
+  uint16_t minuteColorTemp[MINUTES_PER_DAY];
+
+  // Night flag of scheduleIsNight(), valid from nightCheckedAt to nightUntil
+  bool night = false;
+  time_t nightCheckedAt = 0;
+  time_t nightUntil = 0; // Next boundary of the night window
+
+  char etag[SCHEDULE_ETAG_SIZE] = ""; // Sent back as If-None-Match
+};
+
+// Sorts the points by time of day and samples them into minuteColorTemp
+void indexSchedule(LightingSchedule &target);
+int findDaySegment(LightingSchedule &schedule, uint32_t daySeconds);
+// Interpolated between the points, dayPointCount must not be 0
+int interpolateColorTemp(LightingSchedule &schedule, uint32_t daySeconds);
+
+// Colour temperature for unix time `now`, DEFAULT_COLOR_TEMP_K without
+// points or a synced clock
+int scheduleColorTemp(LightingSchedule &schedule, time_t now);
+
+// The schedule's window is in UTC, so its time of day is now % SECONDS_PER_DAY
+bool isNightTime(const LightingSchedule &schedule, uint32_t daySeconds);
+uint32_t secondsToNightBoundary(const LightingSchedule &schedule,
+                                uint32_t daySeconds);
+// isNightTime() at `now`, cached until the next boundary or a clock shift
+bool scheduleIsNight(LightingSchedule &schedule, time_t now);
+
+// Wall clock as of the last tick of inputTask, which reads time() once per
+// tick. A shift of the clock (NTP, the `time` command) shows up as a
+// difference to millis() and is reported in jumpSeconds.
+struct TimeBase {
+  time_t now = 0;
+  uint32_t daySeconds = 0;    // UTC seconds since midnight
+  bool synced = false;        // now >= MIN_VALID_EPOCH_SEC
+  unsigned long tickMs = 0;   // millis() of the last tick
+  long jumpSeconds = 0;       // Shift found by the last tick, 0 if none
+};
+
+void timeBaseTick(TimeBase &base, time_t wallNow, unsigned long nowMs);
+
+void convertColorTempToRGB(int kelvin, uint8_t *r, uint8_t *g, uint8_t *b);
+
+struct PixelColor {
+  uint8_t r, g, b;
+};
+
+// Render pipeline of one zone: base colour from `kelvin`, gamma and white
+// balance corrected through the tables in color_correction.h, then scaled in
+// linear light per pixel by `effect` at `brightness` (0 to PWM_MAX_VALUE).
+// `wipe` is how far EFFECT_SUNRISE has come in, 0 to 255. Channels below
+// DITHER_MAX_COUNT are temporally dithered by `frame`, returns whether any is,
+// the frames then differ and have to keep coming. Integer math only.
+bool renderZonePixels(ZoneEffect effect, int kelvin, int brightness, int wipe,
+                      uint8_t frame, PixelColor *pixels, int count);
+
+// Occupancy estimate from the PIR of a zone. The sample window has one bit
+// per OCCUPANCY_SLOT_MS slot that saw motion, its popcount is the confidence.
+// A glitch fills a single slot, a person keeps the PIR high for longer. Only
+// motion at OCCUPANCY_ARRIVE_SLOTS confidence arrives or restarts the timeout.
+const int OCCUPANCY_WINDOW_SLOTS = 32;
+
+struct OccupancyFilter {
+  bool occupied = false;
+  bool motion = false;  // Level of the last sample
+  uint32_t window = 0;  // Newest slot in bit 0
+  unsigned long lastSampleMs = 0;
+  unsigned long lastMotionMs = 0;
+  unsigned long occupiedSinceMs = 0;
+};
+
+enum OccupancyEvent {
+  OCCUPANCY_NONE,
+  OCCUPANCY_ARRIVED, // Confidence reached OCCUPANCY_ARRIVE_SLOTS
+  OCCUPANCY_LEFT,    // No motion for occupancyTimeoutMs()
+};
+
+// Records a PIR level at `nowMs`, e.g. of an edge. O(1).
+void occupancySample(OccupancyFilter &filter, bool motion, unsigned long nowMs);
+
+// Samples and returns the transition it causes, if any. O(1).
+OccupancyEvent occupancyUpdate(OccupancyFilter &filter, bool motion,
+                               unsigned long nowMs, unsigned long baseTimeoutMs);
+
+// Slots of the window that saw motion, 0 to OCCUPANCY_WINDOW_SLOTS
+inline int occupancyConfidence(const OccupancyFilter &filter) {
+  return __builtin_popcount(filter.window);
+}
+
+// `baseTimeoutMs`, grown by how long the room has been occupied
+unsigned long occupancyTimeoutMs(const OccupancyFilter &filter,
+                                 unsigned long baseTimeoutMs);
+
+// Back to vacant, e.g. when the light was switched off by other means
+void occupancyClear(OccupancyFilter &filter);
+
+#endif // LUMIRUM_LIGHTING_H
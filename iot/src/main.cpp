@@ -1,72 +1,367 @@
 // LumiRum IoT Client for ESP32-C3 with Arduino Framework
 
 #include "config.h"
-#include <Adafruit_NeoPixel.h>
+#include "config_portal.h"
+#include "heap_stats.h"
+#include "json_arena.h"
+#include "led_output.h"
+#include "lighting.h"
+#include "perf_stats.h"
+#include "refresh_timer.h"
+#include "telemetry_encoding.h"
+#include "telemetry_spool.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
 #include <ArduinoJson.h>
 #include <HTTPClient.h>
 #include <Preferences.h>
-#include <WebServer.h>
 #include <WiFi.h>
+#include <driver/gpio.h>
+#include <driver/uart.h>
+#include <esp_http_server.h>
+#include <esp_sleep.h>
+#include <esp_sntp.h>
+#include <lwip/sockets.h>
+
+const size_t SCHEDULE_HEADER_BUFFER_SIZE = 384; // Schedule fields before points
+const size_t SCHEDULE_JSON_ARENA_SIZE = 3072;   // The header or one point
+const size_t TELEMETRY_JSON_ARENA_SIZE = 6144;  // A full batch document
+const size_t TELEMETRY_PAYLOAD_SIZE =
+    TELEMETRY_BATCH_SIZE * 128; // Serialized batch, ~125 bytes per event
+const size_t SERIAL_COMMAND_SIZE = 64;
+
+// Compact schedule representation, layout is documented on
+// LightingSchedule::to_bytes in the server
+#define SCHEDULE_BINARY_CONTENT_TYPE "application/octet-stream"
+const uint8_t SCHEDULE_BINARY_VERSION = 1;
+
+struct __attribute__((packed)) BinaryScheduleHeader {
+  uint8_t version;
+  uint8_t flags; // bit 0: night mode enabled
+  uint16_t pointCount;
+  int64_t profileId;
+  uint32_t sleepStartUtcSeconds;
+  uint32_t sleepEndUtcSeconds;
+  uint16_t minColorTemp;
+  uint16_t maxColorTemp;
+  uint32_t motionTimeoutSeconds;
+  uint32_t generatedAt;
+  uint32_t validUntil;
+};
+static_assert(sizeof(BinaryScheduleHeader) == 36, "must match the server");
+
+struct __attribute__((packed)) BinarySchedulePoint {
+  uint16_t deltaSeconds; // since the previous point, the first since generatedAt
+  uint16_t colorTemp;
+};
 
-const time_t MIN_VALID_EPOCH_SEC = 1735693200; // January 1, 2025 (Ensures NTP sync)
-
-// Algorithm Constants
-const float KELVIN_DIVISOR = 100.0; // Used in Tanner Helland's algorithm
-
-Adafruit_NeoPixel strip(LED_COUNT, PIN_LED_RING, NEO_GRB + NEO_KHZ800);
 Preferences preferences; // Non-volatile storage handler
-WebServer server(WEB_SERVER_PORT);
+Preferences schedulePreferences; // Last good schedule, written by networkTask
+// Config portal, the IDF server runs it in a task of its own
+httpd_handle_t portalServer = nullptr;
 
 String currentApiKey;        // Stores the active API Key (from NVS or Secrets)
-bool isInConfigMode = false; // Flag to stop normal operation and serve Web UI
+volatile bool isInConfigMode = false; // Serving the portal, the light carries on
+volatile bool apiUnauthorized = false; // Set by the network task on a 401
 
-struct DeviceState {
-  bool modeAuto = true;
+constexpr bool sameApiKey(const char *a, const char *b) {
+  while (*a != '\0' && *a == *b) {
+    ++a;
+    ++b;
+  }
+  return *a == *b;
+}
+
+// Whether no earlier zone has the key of `zone`, keyless zones never do
+constexpr bool firstZoneWithKey(int zone) {
+  if (ZONES[zone].apiKey == nullptr)
+    return false;
+  for (int i = 0; i < zone; ++i)
+    if (ZONES[i].apiKey != nullptr && sameApiKey(ZONES[i].apiKey, ZONES[zone].apiKey))
+      return false;
+  return true;
+}
+
+// Schedule slot of a zone. Slot 0 is the schedule of the device's own key,
+// every distinct key of the zones gets the next slot, in order of first use.
+constexpr int zoneScheduleSlot(int zone) {
+  if (ZONES[zone].apiKey == nullptr)
+    return 0;
+  int slot = 0;
+  for (int i = 0; i < ZONE_COUNT; ++i) {
+    if (!firstZoneWithKey(i))
+      continue;
+    ++slot;
+    if (sameApiKey(ZONES[i].apiKey, ZONES[zone].apiKey))
+      break;
+  }
+  return slot;
+}
+
+constexpr int countScheduleSlots() {
+  int count = 1;
+  for (int zone = 0; zone < ZONE_COUNT; ++zone)
+    count += firstZoneWithKey(zone);
+  return count;
+}
+const int SCHEDULE_SLOT_COUNT = countScheduleSlots();
+
+constexpr bool zoneSlotsInRange() {
+  for (int zone = 0; zone < ZONE_COUNT; ++zone)
+    if (zoneScheduleSlot(zone) < 0 || zoneScheduleSlot(zone) >= SCHEDULE_SLOT_COUNT)
+      return false;
+  return true;
+}
+static_assert(zoneSlotsInRange(), "every zone needs a schedule slot");
+
+// Zones that share a PIR are woken by its first zone only
+constexpr bool firstZoneOnPin(int zone) {
+  for (int i = 0; i < zone; ++i)
+    if (ZONES[i].pirPin == ZONES[zone].pirPin)
+      return false;
+  return true;
+}
+
+constexpr bool zonesFitStrip() {
+  for (const ZoneConfig &zone : ZONES)
+    if (zone.firstPixel < 0 || zone.pixelCount <= 0 ||
+        zone.firstPixel + zone.pixelCount > LED_COUNT || zone.pirPin < 0)
+      return false;
+  return true;
+}
+static_assert(ZONE_COUNT > 0 && zonesFitStrip(), "ZONES must lie within LED_COUNT");
+
+struct ZoneState {
   bool lightIsOn = false;
-  int currentBrightnessPercent = 0;
   int currentColorTemp = DEFAULT_COLOR_TEMP_K;
-  unsigned long motionLastSeenMs = 0;
-  time_t lastKnownTimeSeconds = 0;
-  bool scheduleLoaded = false;
-  bool scheduleExpiredWarned = false;
-} state;
-
-struct LightingSchedule {
-  long profileId = 0;
-  uint32_t sleepStartUtcSeconds = 0;
-  uint32_t sleepEndUtcSeconds = 0;
-  int minColorTemp = DEFAULT_COLOR_TEMP_K;
-  int maxColorTemp = 6500; // a sane default
-  bool nightModeEnabled = false;
-  int motionTimeoutSeconds = 300; // 5 minutes
-  time_t generatedAt = 0;
-  time_t validUntil = 0;
+  OccupancyFilter occupancy; // Fed with the PIR of the zone
+};
 
-  struct Point {
-    time_t timestamp;
-    int colorTemp;
-  };
-  Point points[API_MAX_SCHEDULE_SIZE];
-  int pointCount = 0;
-} schedule;
+struct DeviceState {
+  bool modeAuto = true;
+  int currentBrightnessPercent = 0;
+  TimeBase time; // Ticked by handleTimeJump()
+  ZoneState zones[ZONE_COUNT];
+  bool scheduleLoaded[SCHEDULE_SLOT_COUNT] = {};
+  bool scheduleExpiredWarned[SCHEDULE_SLOT_COUNT] = {};
+};
+// Only inputTask writes `state`, other tasks read the copy from readState()
+DeviceState state;
+DeviceState stateSnapshot;
+portMUX_TYPE stateLock = portMUX_INITIALIZER_UNLOCKED;
+
+// Only inputTask writes them, the copies are made by applyPendingSchedule()
+LightingSchedule schedules[SCHEDULE_SLOT_COUNT];
+
+// Written by networkTask under pendingScheduleMutex, applied by inputTask
+// with applyPendingSchedule() so a fetch never blocks the lookups
+enum PendingScheduleStatus { SCHEDULE_NONE, SCHEDULE_READY };
+LightingSchedule pendingSchedules[SCHEDULE_SLOT_COUNT];
+SemaphoreHandle_t pendingScheduleMutex = nullptr;
+std::atomic<int> pendingScheduleStatus[SCHEDULE_SLOT_COUNT]; // SCHEDULE_NONE
+TaskHandle_t networkTaskHandle = nullptr;
+
+// WiFi connection state machine, driven by WiFi events and run by networkTask.
+// Reconnects back off exponentially from WIFI_BACKOFF_MIN_MS.
+enum ConnectionState { CONNECTION_WAITING, CONNECTION_CONNECTING, CONNECTION_ONLINE };
+std::atomic<int> connectionState{CONNECTION_WAITING};
+std::atomic<bool> connectionChanged{false}; // Set by the event handler
+unsigned long connectionDeadlineMs = 0;     // Next attempt, or connect timeout
+unsigned long reconnectBackoffMs = WIFI_BACKOFF_MIN_MS;
+std::atomic<bool> scheduleFetchRequested{false};
+std::atomic<unsigned long> scheduleFetchSpreadMs{FLEET_SPREAD_MS}; // Of the request
+// Next schedule fetch, driven by validUntil. Published so inputTask can wake up
+// for it.
+RefreshTimer scheduleRefresh;
+std::atomic<unsigned long> scheduleRefreshDueMs{0};
+// Fetch attempts of networkTask and whether the last got every schedule,
+// watchTask waits on them after a change
+std::atomic<uint32_t> scheduleFetchCount{0};
+std::atomic<bool> scheduleFetchSucceeded{false};
+
+// Long poll on API_WATCH_ROUTE, on its own connection so the shared one stays
+// free for fetches and telemetry while it waits. HTTPClient gives up on a
+// response after its 16-bit timeout, the watch is written and read by hand.
+WiFiClient watchClient;
+TaskHandle_t watchTaskHandle = nullptr; // Woken when the WiFi comes up or a fetch ends
+
+// SpooledEvent::type, the queue also carries TELEMETRY_FLUSH_MARKER. Binary
+// batches send the code itself, only append, in the order of EVENT_TYPES in
+// the server.
+enum TelemetryEventType : uint8_t {
+  TELEMETRY_MOTION_DETECTED,
+  TELEMETRY_MOTION_TIMEOUT,
+  TELEMETRY_MODE_CHANGE,
+  TELEMETRY_FLUSH_MARKER = 0xFF,
+};
+const char *const TELEMETRY_EVENT_NAMES[] = {"motion_detected", "motion_timeout",
+                                             "mode_change"};
+const int TELEMETRY_EVENT_TYPE_COUNT =
+    sizeof(TELEMETRY_EVENT_NAMES) / sizeof(TELEMETRY_EVENT_NAMES[0]);
+
+// What a zone is rendered from, brightness is 0 (off) to PWM_MAX_VALUE and
+// wipe how far EFFECT_SUNRISE has come in (0 to 255)
+struct ZoneFrame {
+  int brightness = 0;
+  int colorTemp = DEFAULT_COLOR_TEMP_K;
+  int wipe = 255;
+
+  bool operator==(const ZoneFrame &other) const {
+    return brightness == other.brightness && colorTemp == other.colorTemp &&
+           wipe == other.wipe;
+  }
+};
+
+// Zones currently on the strip, so the render task can skip identical frames
+struct RenderedOutput {
+  bool valid = false; // false forces the next render
+  ZoneFrame zones[ZONE_COUNT];
+  uint8_t frame = 0;                    // Dither phase
+  std::atomic<bool> dithering{false};   // Frames differ even when zones do not
+} rendered;
+
+// Fades the render task is running, the wipe always ends at 255.
+// Written by updateLighting(), read by renderTask, guarded by transitionLock.
+struct Transition {
+  ZoneFrame from;
+  int toBrightness = 0;
+  int toColorTemp = DEFAULT_COLOR_TEMP_K;
+  unsigned long startMs = 0;
+  unsigned long durationMs = 0;
+};
+Transition transitions[ZONE_COUNT];
+portMUX_TYPE transitionLock = portMUX_INITIALIZER_UNLOCKED;
+TaskHandle_t renderTaskHandle = nullptr;
+
+// Smoothstep ease-in-out, EASING_SCALE at the last step
+const int EASING_STEPS = 256;
+const int32_t EASING_SCALE = 1024;
+
+constexpr std::array<uint16_t, EASING_STEPS> buildEasingCurve() {
+  std::array<uint16_t, EASING_STEPS> curve = {};
+  const int64_t last = EASING_STEPS - 1;
+  for (int64_t t = 0; t <= last; ++t)
+    curve[t] = (3 * t * t * last - 2 * t * t * t) * EASING_SCALE / (last * last * last);
+  return curve;
+}
+constexpr std::array<uint16_t, EASING_STEPS> EASING_CURVE = buildEasingCurve();
+
+// Shared keep-alive connection to API_BASE_URL, guarded by apiMutex since the
+// schedule fetch and the telemetry task both use it
+WiFiClient apiClient;
+HTTPClient apiHttp;
+SemaphoreHandle_t apiMutex = nullptr;
+
+// JsonDocument memory, one arena per task so steady state never touches the
+// heap. Used by networkTask and telemetryTask respectively.
+JsonArena<SCHEDULE_JSON_ARENA_SIZE> scheduleJsonArena;
+JsonArena<TELEMETRY_JSON_ARENA_SIZE> telemetryJsonArena;
+
+// Fixed-size ring buffer drained by telemetryTask into the spool, so
+// inputTask never waits on the network
+QueueHandle_t telemetryQueue = nullptr;
+SemaphoreHandle_t telemetryFlushed = nullptr; // Given after a requested flush
+TaskHandle_t telemetryTaskHandle = nullptr;
+// Published by telemetryTask so inputTask can wake up for the next upload
+std::atomic<bool> telemetryUploadPending{false};
+std::atomic<unsigned long> telemetryUploadDueMs{0};
+
+// GPIO edges timestamped by the ISRs, drained by inputTask. All GPIO interrupts
+// are dispatched from one handler on the single core, so this is a
+// single-producer single-consumer ring and needs no lock.
+struct InputEdge {
+  uint8_t pin;
+  uint8_t level;
+  uint32_t micros;
+};
+InputEdge inputEdges[INPUT_QUEUE_LENGTH];
+std::atomic<uint32_t> inputHead{0}; // Written by the ISRs only
+std::atomic<uint32_t> inputTail{0}; // Written by inputTask only
+std::atomic<bool> inputOverflow{false};
+TaskHandle_t inputTaskHandle = nullptr; // Woken on every edge
+
+// Input state rebuilt from the edges
+bool pirLevels[ZONE_COUNT] = {}; // Of the PIR of every zone
+uint32_t lastButtonPressUs = 0;
+bool buttonPressedOnce = false;
 
 // Function declarations
-void setupWiFi();
-void setupTime();
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info);
+void onTimeSynced(struct timeval *tv);
+unsigned long serviceConnection(unsigned long nowMs);
+void startConnecting(unsigned long nowMs);
 void loadApiKey();
-void fetchSchedule();
-void sendTelemetry(const char *eventType, bool motionDetected);
-int getCurrentColorTemp();
+void setupApi();
+bool apiBegin(const char *url, const char *apiKey = nullptr);
+int apiSend(const char *method, uint8_t *payload = nullptr, size_t size = 0);
+void apiDrain();
+void apiEnd();
+void setupNetwork();
+void networkTask(void *parameter);
+void requestScheduleFetch(unsigned long spreadMs = FLEET_SPREAD_MS);
+unsigned long untilScheduleRefreshMs();
+bool fetchSchedules();
+bool fetchSchedule(int slot);
+const char *slotApiKey(int slot);
+void watchTask(void *parameter);
+bool awaitScheduleFetch();
+int watchSchedule();
+int watchRequest(const char *etag);
+bool watchConnect();
+void applyPendingSchedule();
+void saveSchedule(int slot, const LightingSchedule &source);
+void restoreSchedules();
+bool restoreSchedule(int slot, LightingSchedule &target);
+void applyBinaryHeader(const BinaryScheduleHeader &header,
+                       LightingSchedule &target);
+bool parseJsonSchedule(Stream &stream, int size, LightingSchedule &target);
+bool parseBinarySchedule(Stream &stream, LightingSchedule &target);
+time_t parseIsoTime(const char *str);
+void sendTelemetry(TelemetryEventType type, const ZoneState &zone,
+                   bool motionDetected);
+void setupTelemetry();
+void flushTelemetry();
+void telemetryTask(void *parameter);
+bool postTelemetryBatch(const SpooledEvent *events, int count);
+int postTelemetryPayload(const char *contentType, const uint8_t *payload,
+                         size_t length);
+bool telemetryBatchDone(int httpCode);
+int getCurrentColorTemp(int zone);
+void setupRendering();
+void renderTask(void *parameter);
+bool sampleTransitions(unsigned long nowMs, ZoneFrame *frames);
+bool sampleTransition(const Transition &transition, unsigned long nowMs,
+                      ZoneFrame *frame);
+void renderFrame(const ZoneFrame *frames);
 void updateLighting();
-void handleButton();
+void invalidateLighting();
+void setupInput();
+void inputTask(void *parameter);
+void publishState();
+DeviceState readState();
+void showConfigModeCue();
+void IRAM_ATTR onButtonEdge();
+void IRAM_ATTR onPirEdge(void *pin);
+void IRAM_ATTR pushInputEdge(uint8_t pin);
+void handleInputEdges();
+void handleButtonEdge(uint8_t level, uint32_t edgeUs);
+void handleButtonPress();
+void handlePirEdge(uint8_t pin, uint8_t level, uint32_t edgeUs);
+void setAllZonesOn(bool on);
+void waitForNextEvent();
+unsigned long untilNextDeadlineMs(unsigned long nowMs);
+bool canLightSleep();
+void lightSleep(unsigned long durationMs);
 void handleMotion();
 void handleBrightnessPot();
 void handleTimeJump();
-void convertColorTempToRGB(int kelvin, uint8_t *r, uint8_t *g, uint8_t *b);
-bool isNightTime();
+unsigned long motionTimeoutMs(int zone);
 void setSerialCommands();
 void enterConfigMode();
-void handleConfigPortal();
+esp_err_t onPortalPage(httpd_req_t *request);
+esp_err_t onPortalSave(httpd_req_t *request);
 
 void setup() {
   Serial.begin(115200);
@@ -74,57 +369,51 @@ void setup() {
   Serial.println("LumiRum IoT Client v1.0");
 
   // Hardware Init
-  pinMode(PIN_PIR_SENSOR, INPUT);
+  for (const ZoneConfig &zone : ZONES)
+    pinMode(zone.pirPin, INPUT);
   pinMode(PIN_BUTTON, INPUT_PULLUP);
   pinMode(PIN_POTENTIOMETER, INPUT);
 
-  strip.begin();
-  strip.setBrightness(DEFAULT_BRIGHTNESS_LIMIT_PERCENT);
-  strip.show();
+  ledOutputBegin();
+  ledOutputClear();
+  ledOutputShow();
+  setupRendering();
   Serial.println("[INIT] LED strip initialized");
 
   // Load Preferences (NVS)
   loadApiKey();
-
-  setupWiFi();
-  setupTime();
-  fetchSchedule();
-
-  if (isInConfigMode) {
-    Serial.println("\n[!] AUTHENTICATION FAILED");
-    Serial.println("[!] Device is in CONFIGURATION MODE");
-    Serial.println("[!] Open your browser at: http://localhost:8180");
-  } else {
-    state.lastKnownTimeSeconds = time(nullptr);
-    Serial.println("\n[READY] Device is ready!");
-    Serial.println(
-        "Commands: 'status', 'reset_key', 'fetch', 'time YYYY-MM-DD HH:MM:SS'");
-  }
+  setupApi();
+  setupTelemetry();
+
+  // The stored schedules are used until networkTask has fetched new ones.
+  // WiFi, NTP and the fetch all happen in the background, a 401 there enters
+  // config mode from loop().
+  pendingScheduleMutex = xSemaphoreCreateMutex();
+  restoreSchedules();
+  applyPendingSchedule();
+  setupNetwork();
+
+  timeBaseTick(state.time, time(nullptr), millis());
+  publishState();
+  setupInput();
+
+  Serial.println("\n[READY] Device is ready!");
+  Serial.println(
+      "Commands: 'status', 'perf', 'perf reset', 'heap', 'heap reset', "
+      "'reset_key', 'fetch', 'time YYYY-MM-DD HH:MM:SS'");
 }
 
-unsigned long lastScheduleCheckMs = 0;
-
+// Only serial commands are left here, inputs, rendering, the network and the
+// config portal each run in their own task
 void loop() {
-  // If we hit a 401 error, enter config mode to update the key
-  if (isInConfigMode) {
-    server.handleClient();
-
-    delay(10);
-    return;
-  }
+  // If we hit a 401 error, serve the config portal to update the key
+  if (apiUnauthorized && !isInConfigMode)
+    enterConfigMode();
 
+  uint32_t perf = perfStart();
   setSerialCommands();
-  handleTimeJump();
-  handleButton();
-  handleMotion();
-  handleBrightnessPot();
-  updateLighting();
-
-  if (millis() - lastScheduleCheckMs > SCHEDULE_REFRESH_INTERVAL_MS) {
-    fetchSchedule();
-    lastScheduleCheckMs = millis();
-  }
-
+  perfStop(PERF_SERIAL_COMMANDS, perf);
+  heapStatsSample(millis());
   delay(LOOP_DELAY_MS);
 }
 
@@ -141,196 +430,1044 @@ void loadApiKey() {
   }
 }
 
-void setupWiFi() {
-  Serial.print("[WiFi] Connecting to ");
-  Serial.print(WIFI_SSID);
-  Serial.print("...");
+void setupApi() {
+  static const char *responseHeaders[] = {"Content-Type", "ETag"};
 
-  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+  apiMutex = xSemaphoreCreateMutex();
+  apiHttp.setReuse(true); // HTTP/1.1 keep-alive, end() leaves the socket open
+  apiHttp.collectHeaders(responseHeaders,
+                         sizeof(responseHeaders) / sizeof(responseHeaders[0]));
+}
 
-  int attempts = 0;
-  while (WiFi.status() != WL_CONNECTED && attempts < MAX_WIFI_ATTEMPTS) {
-    delay(WIFI_RETRY_DELAY_MS);
-    Serial.print(".");
-    ++attempts;
+// Starts a request on the shared connection, apiMutex is held until apiEnd().
+// `url` is built at compile time, e.g. API_BASE_URL API_FETCH_ROUTE. Without
+// `apiKey` the request is made as the device itself.
+bool apiBegin(const char *url, const char *apiKey) {
+  xSemaphoreTake(apiMutex, portMAX_DELAY);
+
+  if (!apiHttp.begin(apiClient, url)) {
+    Serial.println("[ERROR] Invalid API URL");
+    xSemaphoreGive(apiMutex);
+    return false;
   }
+  if (apiKey != nullptr)
+    apiHttp.addHeader(API_KEY_HEADER, apiKey);
+  else
+    apiHttp.addHeader(API_KEY_HEADER, currentApiKey);
+  return true;
+}
 
-  if (WiFi.status() == WL_CONNECTED) {
-    Serial.println(" Connected!");
-    Serial.print("[WiFi] IP Address: ");
-    Serial.println(WiFi.localIP());
-  } else {
-    Serial.println(" Failed!");
-    Serial.println(
-        "[ERROR] Could not connect to WiFi. Device will work in offline mode.");
+// Sends the request, reconnecting once if the kept-alive socket went stale
+// (server idle timeout, WiFi reconnect)
+int apiSend(const char *method, uint8_t *payload, size_t size) {
+  int httpCode = apiHttp.sendRequest(method, payload, size);
+
+  if (httpCode == HTTPC_ERROR_SEND_HEADER_FAILED ||
+      httpCode == HTTPC_ERROR_SEND_PAYLOAD_FAILED ||
+      httpCode == HTTPC_ERROR_NOT_CONNECTED ||
+      httpCode == HTTPC_ERROR_CONNECTION_LOST) {
+    Serial.println("[API] Connection lost, reconnecting...");
+    apiClient.stop();
+    httpCode = apiHttp.sendRequest(method, payload, size);
   }
+
+  return httpCode;
 }
 
-void setupTime() {
-  Serial.println("[Time] Synchronizing with NTP server...");
-  configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+// Consumes an unread response body so the next request starts clean
+void apiDrain() {
+  int remaining = apiHttp.getSize();
+  if (remaining <= 0)
+    return;
 
-  time_t now = time(nullptr);
-  int attempts = 0;
-  while (now < MIN_VALID_EPOCH_SEC && attempts < MAX_WIFI_ATTEMPTS) {
-    delay(WIFI_RETRY_DELAY_MS);
-    Serial.print(".");
-    now = time(nullptr);
-    ++attempts;
+  WiFiClient &stream = apiHttp.getStream();
+  uint8_t buffer[64];
+  while (remaining > 0) {
+    size_t read = stream.readBytes(buffer, min(remaining, (int)sizeof(buffer)));
+    if (read == 0)
+      break;
+    remaining -= read;
   }
+}
 
-  if (now > MIN_VALID_EPOCH_SEC) {
-    Serial.println(" Synchronized!");
-    Serial.print("[Time] Current UTC: ");
-    Serial.println(ctime(&now));
-  } else {
-    Serial.println(" Failed!");
-    Serial.println("[WARN] Could not sync time. Using default time.");
+void apiEnd() {
+  apiHttp.end();
+  xSemaphoreGive(apiMutex);
+}
+
+void setupNetwork() {
+  if (pendingScheduleMutex == nullptr ||
+      xTaskCreate(networkTask, "network", NETWORK_TASK_STACK_SIZE, nullptr,
+                  NETWORK_TASK_PRIORITY, &networkTaskHandle) != pdPASS) {
+    Serial.println("[ERROR] Could not start network task");
+    return;
   }
+  if (xTaskCreate(watchTask, "watch", NETWORK_TASK_STACK_SIZE, nullptr,
+                  NETWORK_TASK_PRIORITY, &watchTaskHandle) != pdPASS)
+    Serial.println("[ERROR] Could not start schedule watch task");
+
+  sntp_set_time_sync_notification_cb(onTimeSynced);
+  WiFi.onEvent(onWiFiEvent);
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false); // Reconnects are paced by serviceConnection()
+  WiFi.setSleep(WIFI_PS_MIN_MODEM); // Radio off between beacons, stays associated
+  Serial.println("[INIT] Network task started");
 }
 
-void fetchSchedule() {
-  if (WiFi.status() != WL_CONNECTED) {
-    Serial.println("[ERROR] Cannot fetch schedule - no WiFi connection");
+// Keeps the connection up and runs schedule fetches, boot never waits on it.
+// Fetches follow scheduleRefresh, failed ones back off up to
+// SCHEDULE_RETRY_MAX_MS.
+void networkTask(void *parameter) {
+  // The stored schedules are current until their refresh is due
+  refreshBegin(scheduleRefresh, refreshSeed(currentApiKey.c_str()), millis());
+  refreshAfter(scheduleRefresh, millis(), untilScheduleRefreshMs(),
+               SCHEDULE_REFRESH_JITTER_MS);
+
+  for (;;) {
+    unsigned long waitMs = serviceConnection(millis());
+
+    unsigned long nowMs = millis();
+    if (scheduleFetchRequested.exchange(false))
+      refreshWithin(scheduleRefresh, nowMs, scheduleFetchSpreadMs);
+
+    bool online = connectionState == CONNECTION_ONLINE && !apiUnauthorized;
+    if (online && refreshDue(scheduleRefresh, nowMs)) {
+      unsigned long startUs = micros();
+      bool fetched = fetchSchedules();
+      perfRecordUs(PERF_FETCH_SCHEDULE, micros() - startUs);
+
+      if (fetched)
+        refreshAfter(scheduleRefresh, millis(), untilScheduleRefreshMs(),
+                     SCHEDULE_REFRESH_JITTER_MS);
+      else
+        refreshFailed(scheduleRefresh, millis(), SCHEDULE_RETRY_MIN_MS,
+                      SCHEDULE_RETRY_MAX_MS);
+      scheduleRefreshDueMs = scheduleRefresh.dueMs;
+      scheduleFetchSucceeded = fetched;
+      ++scheduleFetchCount;
+
+      // Let inputTask pick the result up right away, watchTask may be waiting
+      if (inputTaskHandle != nullptr)
+        xTaskNotifyGive(inputTaskHandle);
+      if (watchTaskHandle != nullptr)
+        xTaskNotifyGive(watchTaskHandle);
+      continue;
+    }
+    scheduleRefreshDueMs = scheduleRefresh.dueMs;
+
+    // Offline a due fetch waits for the reconnect, which spreads it anew
+    if (online)
+      waitMs = std::min(waitMs, refreshRemainingMs(scheduleRefresh, nowMs));
+    ulTaskNotifyTake(pdTRUE, waitMs == ULONG_MAX ? portMAX_DELAY
+                                                 : pdMS_TO_TICKS(waitMs));
+  }
+}
+
+// Runs in the WiFi event task, only records the change for networkTask
+void onWiFiEvent(arduino_event_id_t event, arduino_event_info_t info) {
+  switch (event) {
+  case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+    connectionState = CONNECTION_ONLINE;
+    break;
+  case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+  case ARDUINO_EVENT_WIFI_STA_LOST_IP:
+    if (connectionState == CONNECTION_WAITING)
+      return;
+    connectionState = CONNECTION_WAITING;
+    break;
+  default:
     return;
   }
 
-  Serial.println("\n[API] Fetching lighting schedule...");
+  connectionChanged = true;
+  if (networkTaskHandle != nullptr)
+    xTaskNotifyGive(networkTaskHandle);
+}
 
-  HTTPClient http;
-  String url = String(API_BASE_URL) + API_FETCH_ROUTE;
+void onTimeSynced(struct timeval *tv) {
+  Serial.print("[Time] Synchronized, UTC: ");
+  Serial.print(ctime(&tv->tv_sec));
+  // The time base picks the shift up on its next tick, make that now
+  if (inputTaskHandle != nullptr)
+    xTaskNotifyGive(inputTaskHandle);
+}
 
-  http.begin(url);
-  http.addHeader(API_KEY_HEADER, currentApiKey);
+// Advances the connection state machine, returns the time until it needs to
+// run again (ULONG_MAX if only an event can change anything)
+unsigned long serviceConnection(unsigned long nowMs) {
+  static bool started = false;
+  if (!started) {
+    started = true;
+    startConnecting(nowMs);
+  }
 
-  int httpCode = http.GET();
+  if (connectionChanged.exchange(false)) {
+    if (connectionState == CONNECTION_ONLINE) {
+      Serial.print("[WiFi] Connected, IP Address: ");
+      Serial.println(WiFi.localIP());
+      reconnectBackoffMs = WIFI_BACKOFF_MIN_MS;
+
+      // Restarts SNTP, it then keeps resyncing on its own while online
+      configTime(0, 0, "pool.ntp.org", "time.nist.gov");
+      // Updates may have been missed while offline
+      scheduleFetchSpreadMs = FLEET_SPREAD_MS;
+      scheduleFetchRequested = true;
+      // Spooled telemetry goes out now instead of at the next retry
+      if (telemetryTaskHandle != nullptr)
+        xTaskAbortDelay(telemetryTaskHandle);
+      if (watchTaskHandle != nullptr)
+        xTaskNotifyGive(watchTaskHandle);
+    } else {
+      Serial.print("[WiFi] Disconnected, retrying in ");
+      Serial.print(reconnectBackoffMs);
+      Serial.println(" ms");
+      connectionDeadlineMs = nowMs + reconnectBackoffMs;
+      reconnectBackoffMs = std::min(reconnectBackoffMs * 2, WIFI_BACKOFF_MAX_MS);
+    }
+  }
 
-  if (httpCode == HTTP_CODE_UNAUTHORIZED) {
-    Serial.println("[ERROR] 401 Unauthorized. API Key invalid.");
-    enterConfigMode();
-    http.end();
-    return;
+  if (connectionState == CONNECTION_ONLINE)
+    return ULONG_MAX;
+
+  if ((long)(nowMs - connectionDeadlineMs) < 0)
+    return connectionDeadlineMs - nowMs;
+
+  if (connectionState == CONNECTION_CONNECTING) {
+    // No event at all, e.g. the AP is gone, counts as a failed attempt
+    Serial.println("[WiFi] Connection attempt timed out");
+    connectionState = CONNECTION_WAITING; // Before the event it causes
+    WiFi.disconnect();
+    connectionDeadlineMs = nowMs + reconnectBackoffMs;
+    reconnectBackoffMs = std::min(reconnectBackoffMs * 2, WIFI_BACKOFF_MAX_MS);
+    return connectionDeadlineMs - nowMs;
   }
 
-  if (httpCode == HTTP_CODE_OK) {
-    String payload = http.getString();
+  startConnecting(nowMs);
+  return WIFI_CONNECT_TIMEOUT_MS;
+}
 
-    JsonDocument doc;
-    DeserializationError error = deserializeJson(doc, payload);
+void startConnecting(unsigned long nowMs) {
+  Serial.print("[WiFi] Connecting to ");
+  Serial.println(WIFI_SSID);
 
-    if (error) {
-      Serial.print("[ERROR] JSON parsing failed: ");
-      Serial.println(error.c_str());
-      http.end();
-      return;
-    }
+  connectionState = CONNECTION_CONNECTING;
+  connectionDeadlineMs = nowMs + WIFI_CONNECT_TIMEOUT_MS;
+  WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
+}
+
+// Returns right away, the fetch runs in networkTask within `spreadMs`
+void requestScheduleFetch(unsigned long spreadMs) {
+  if (networkTaskHandle == nullptr)
+    return;
+
+  scheduleFetchSpreadMs = spreadMs;
+  scheduleFetchRequested = true;
+  xTaskNotifyGive(networkTaskHandle);
+}
+
+// Until SCHEDULE_REFRESH_LEAD_SEC before the first of the schedules expires,
+// without the jitter
+unsigned long untilScheduleRefreshMs() {
+  time_t validUntil = 0;
+  // Only networkTask writes pendingSchedules
+  for (const LightingSchedule &schedule : pendingSchedules)
+    if (schedule.pointCount > 0 &&
+        (validUntil == 0 || schedule.validUntil < validUntil))
+      validUntil = schedule.validUntil;
+  return scheduleRefreshDelayMs(validUntil, time(nullptr));
+}
 
-    schedule.profileId = doc["profile_id"];
-    schedule.sleepStartUtcSeconds = doc["sleep_start_utc_seconds"];
-    schedule.sleepEndUtcSeconds = doc["sleep_end_utc_seconds"];
-    schedule.minColorTemp = doc["min_color_temp"];
-    schedule.maxColorTemp = doc["max_color_temp"];
-    schedule.nightModeEnabled = doc["night_mode_enabled"];
-    schedule.motionTimeoutSeconds = doc["motion_timeout_seconds"];
+// Every slot in turn, each one still only downloads when its ETag changed.
+// Returns whether all of them got an answer.
+bool fetchSchedules() {
+  bool fetched = true;
+  for (int slot = 0; slot < SCHEDULE_SLOT_COUNT && !apiUnauthorized; ++slot)
+    fetched &= fetchSchedule(slot);
+  return fetched;
+}
 
-    // Parse ISO8601 timestamps
-    const char *generatedAtStr = doc["generated_at"];
-    const char *validUntilStr = doc["valid_until"];
+// Key of the first zone using `slot`, nullptr for the device's own
+const char *slotApiKey(int slot) {
+  for (int zone = 0; zone < ZONE_COUNT; ++zone)
+    if (zoneScheduleSlot(zone) == slot)
+      return ZONES[zone].apiKey;
+  return nullptr;
+}
 
-    struct tm tmGenerated, tmValid;
-    strptime(generatedAtStr, "%Y-%m-%dT%H:%M:%S", &tmGenerated);
-    strptime(validUntilStr, "%Y-%m-%dT%H:%M:%S", &tmValid);
+// Returns false if it should be retried
+bool fetchSchedule(int slot) {
+  if (WiFi.status() != WL_CONNECTED) {
+    Serial.println("[ERROR] Cannot fetch schedule - no WiFi connection");
+    return false;
+  }
 
-    schedule.generatedAt = mktime(&tmGenerated);
-    schedule.validUntil = mktime(&tmValid);
+  Serial.print("\n[API] Fetching lighting schedule");
+  if (slot > 0) {
+    Serial.print(" of slot ");
+    Serial.print(slot);
+  }
+  Serial.println("...");
+
+  const char *apiKey = slotApiKey(slot);
+  if (!apiBegin(API_BASE_URL API_FETCH_ROUTE, apiKey))
+    return false;
+  // The JSON fallback keeps older servers working
+  apiHttp.addHeader("Accept",
+                    SCHEDULE_BINARY_CONTENT_TYPE ", application/json;q=0.5");
+  // pendingSchedules is only written by this task, no lock needed to read it
+  LightingSchedule &pendingSchedule = pendingSchedules[slot];
+  if (pendingSchedule.etag[0] != '\0')
+    apiHttp.addHeader("If-None-Match", pendingSchedule.etag);
+
+  int httpCode = apiSend("GET");
+
+  if (httpCode == HTTP_CODE_UNAUTHORIZED) {
+    Serial.println("[ERROR] 401 Unauthorized. API Key invalid.");
+    // The config portal only replaces the device key, a zone key is fixed
+    // in config.h and its zones keep their last schedule
+    if (apiKey == nullptr)
+      apiUnauthorized = true;
+    apiEnd();
+    return apiKey != nullptr; // Retrying does not fix a zone key
+  }
 
-    JsonArray scheduleArray = doc["schedule"];
-    schedule.pointCount = min((int)scheduleArray.size(), API_MAX_SCHEDULE_SIZE);
+  if (httpCode == HTTP_CODE_NOT_MODIFIED) {
+    Serial.println("[API] Schedule unchanged");
+    apiEnd();
+    return true;
+  }
 
-    for (int i = 0; i < schedule.pointCount; ++i) {
-      JsonObject point = scheduleArray[i];
+  if (httpCode == HTTP_CODE_OK) {
+    String etag = apiHttp.header("ETag");
+    bool binary =
+        apiHttp.header("Content-Type").startsWith(SCHEDULE_BINARY_CONTENT_TYPE);
+
+    // Streamed without the lock, a failed parse leaves pendingSchedules alone
+    static LightingSchedule fetched;
+    bool parsed = binary ? parseBinarySchedule(apiHttp.getStream(), fetched)
+                         : parseJsonSchedule(apiHttp.getStream(),
+                                             apiHttp.getSize(), fetched);
+    if (parsed) {
+      indexSchedule(fetched);
+      strlcpy(fetched.etag, etag.c_str(), sizeof(fetched.etag));
+    }
 
-      const char *utcStr = point["utc"];
-      struct tm tm;
-      strptime(utcStr, "%Y-%m-%dT%H:%M:%S", &tm);
-      schedule.points[i].timestamp = mktime(&tm);
+    xSemaphoreTake(pendingScheduleMutex, portMAX_DELAY);
+    if (parsed) {
+      pendingSchedule = fetched;
+      pendingScheduleStatus[slot] = SCHEDULE_READY;
+    } else {
+      // The zones keep the schedule they have, the retry downloads it whole
+      pendingSchedule.etag[0] = '\0';
+    }
+    xSemaphoreGive(pendingScheduleMutex);
 
-      schedule.points[i].colorTemp = point["temp"];
+    if (!parsed) {
+      apiEnd();
+      return false;
     }
 
-    state.scheduleLoaded = true;
-    state.scheduleExpiredWarned = false;
+    saveSchedule(slot, pendingSchedule);
 
     Serial.println("[API] Schedule loaded successfully!");
     Serial.print("[API] Profile ID: ");
-    Serial.println(schedule.profileId);
+    Serial.println(pendingSchedule.profileId);
     Serial.print("[API] Points loaded: ");
-    Serial.println(schedule.pointCount);
+    Serial.println(pendingSchedule.pointCount);
     Serial.print("[API] Motion timeout: ");
-    Serial.print(schedule.motionTimeoutSeconds);
+    Serial.print(pendingSchedule.motionTimeoutSeconds);
     Serial.println(" seconds");
     Serial.print("[API] Night mode: ");
-    Serial.println(schedule.nightModeEnabled ? "Enabled" : "Disabled");
+    Serial.println(pendingSchedule.nightModeEnabled ? "Enabled" : "Disabled");
+    apiEnd();
+    return true;
+  }
 
-  } else {
-    Serial.print("[ERROR] HTTP request failed with code: ");
+  Serial.print("[ERROR] HTTP request failed with code: ");
+  Serial.println(httpCode);
+  if (httpCode > 0)
+    Serial.println(apiHttp.getString());
+  apiEnd();
+  return false;
+}
+
+// Waits for the server to report a schedule change and has networkTask fetch
+// it before polling again. Schedules that only got old are left to the
+// jittered validUntil refresh. Errors, e.g. a server without the route, and
+// failed fetches back off up to SCHEDULE_WATCH_RETRY_MAX_MS.
+void watchTask(void *parameter) {
+  unsigned long retryBackoffMs = 0;
+
+  // Seconds in this core, select() in watchRequest() covers the hold itself
+  watchClient.setTimeout(SCHEDULE_WATCH_READ_TIMEOUT_S);
+
+  for (;;) {
+    if (connectionState != CONNECTION_ONLINE || apiUnauthorized ||
+        isInConfigMode) {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      continue;
+    }
+
+    int httpCode = watchSchedule();
+    unsigned long waitMs = 0;
+
+    if (httpCode == HTTP_CODE_NOT_MODIFIED) {
+      retryBackoffMs = 0;
+    } else if (httpCode == HTTP_CODE_NO_CONTENT) {
+      Serial.println("[API] Schedule changed on the server");
+      // Polling again with the old ETag would only get another 204
+      if (awaitScheduleFetch()) {
+        retryBackoffMs = 0;
+      } else {
+        retryBackoffMs = retryBackoffMs == 0
+                             ? SCHEDULE_WATCH_RETRY_MIN_MS
+                             : std::min(retryBackoffMs * 2, SCHEDULE_WATCH_RETRY_MAX_MS);
+        waitMs = retryBackoffMs;
+      }
+    } else if (httpCode == HTTP_CODE_UNAUTHORIZED) {
+      apiUnauthorized = true;
+      continue;
+    } else {
+      retryBackoffMs = retryBackoffMs == 0
+                           ? SCHEDULE_WATCH_RETRY_MIN_MS
+                           : std::min(retryBackoffMs * 2, SCHEDULE_WATCH_RETRY_MAX_MS);
+      waitMs = retryBackoffMs;
+    }
+
+    // Light sleep aborts the delay, the remaining time is taken from millis()
+    unsigned long untilMs = millis() + waitMs;
+    long remainingMs;
+    while ((remainingMs = (long)(untilMs - millis())) > 0 &&
+           connectionState == CONNECTION_ONLINE)
+      vTaskDelay(pdMS_TO_TICKS(remainingMs));
+  }
+}
+
+// Requests a fetch, spread over FLEET_SPREAD_MS like the whole fleet's, and
+// waits for networkTask to run it. Returns whether it got every schedule.
+bool awaitScheduleFetch() {
+  uint32_t fetches = scheduleFetchCount;
+  requestScheduleFetch();
+
+  // Bounded in case networkTask is stuck behind a slow request
+  unsigned long untilMs = millis() + FLEET_SPREAD_MS + SCHEDULE_FETCH_WAIT_MS;
+  long remainingMs;
+  while (scheduleFetchCount == fetches && connectionState == CONNECTION_ONLINE &&
+         (remainingMs = (long)(untilMs - millis())) > 0)
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(remainingMs));
+  return scheduleFetchCount != fetches && scheduleFetchSucceeded;
+}
+
+// Returns the status of one long poll, 204 if the schedule changed. Only the
+// device's own schedule is watched, the server authenticates a watch as one
+// device. Zones with a key of their own are refreshed along with it on a 204,
+// otherwise ahead of their validUntil.
+int watchSchedule() {
+  char etag[SCHEDULE_ETAG_SIZE];
+  xSemaphoreTake(pendingScheduleMutex, portMAX_DELAY);
+  strlcpy(etag, pendingSchedules[0].etag, sizeof(etag));
+  xSemaphoreGive(pendingScheduleMutex);
+
+  bool reused = watchClient.connected();
+  int httpCode = watchRequest(etag);
+  if (reused && (httpCode == HTTPC_ERROR_CONNECTION_LOST ||
+                 httpCode == HTTPC_ERROR_SEND_HEADER_FAILED)) {
+    watchClient.stop(); // Kept-alive socket went stale, retry once
+    httpCode = watchRequest(etag);
+  }
+
+  if (httpCode <= 0)
+    watchClient.stop();
+  else if (httpCode != HTTP_CODE_NO_CONTENT && httpCode != HTTP_CODE_NOT_MODIFIED) {
+    Serial.print("[ERROR] Schedule watch failed with code: ");
     Serial.println(httpCode);
-    if (httpCode > 0)
-      Serial.println(http.getString());
   }
+  return httpCode;
+}
 
-  http.end();
+// One GET of API_WATCH_ROUTE on watchClient, which stays open for the next
+// unless the server closes it. Returns the status or an HTTPC_ERROR code.
+int watchRequest(const char *etag) {
+  if (!watchClient.connected() && !watchConnect())
+    return HTTPC_ERROR_CONNECTION_REFUSED;
+
+  char request[256];
+  int length = snprintf(request, sizeof(request),
+                        "GET " API_WATCH_ROUTE " HTTP/1.1\r\n"
+                        "Host: %s\r\n" API_KEY_HEADER ": %s\r\n%s%s%s\r\n",
+                        API_BASE_URL + strlen("http://"), currentApiKey.c_str(),
+                        etag[0] != '\0' ? "If-None-Match: " : "", etag,
+                        etag[0] != '\0' ? "\r\n" : "");
+  if (watchClient.write((const uint8_t *)request, length) != (size_t)length)
+    return HTTPC_ERROR_SEND_HEADER_FAILED;
+
+  // Blocks in lwIP for as long as the server holds the request
+  int fd = watchClient.fd();
+  fd_set readable;
+  FD_ZERO(&readable);
+  FD_SET(fd, &readable);
+  timeval timeout = {(time_t)(SCHEDULE_WATCH_TIMEOUT_MS / 1000), 0};
+  int ready = select(fd + 1, &readable, nullptr, nullptr, &timeout);
+  if (ready == 0)
+    return HTTPC_ERROR_READ_TIMEOUT;
+  if (ready < 0 || watchClient.available() <= 0)
+    return HTTPC_ERROR_CONNECTION_LOST; // Closed or reset, e.g. keep-alive failed
+
+  char line[160];
+  size_t lineLength = watchClient.readBytesUntil('\n', line, sizeof(line) - 1);
+  line[lineLength] = '\0';
+  int httpCode;
+  if (sscanf(line, "HTTP/1.%*d %d", &httpCode) != 1)
+    return HTTPC_ERROR_CONNECTION_LOST;
+
+  long contentLength = 0;
+  bool keepAlive = true;
+  while ((lineLength = watchClient.readBytesUntil('\n', line, sizeof(line) - 1)) > 1) {
+    line[lineLength] = '\0';
+    if (strncasecmp(line, "Content-Length:", 15) == 0)
+      contentLength = atol(line + 15);
+    else if (strncasecmp(line, "Connection: close", 17) == 0)
+      keepAlive = false;
+  }
+  if (lineLength == 0)
+    return HTTPC_ERROR_CONNECTION_LOST; // Headers cut off
+
+  // The body of an error only matters to the log
+  while (contentLength > 0 && watchClient.read() >= 0)
+    --contentLength;
+  if (!keepAlive || contentLength > 0)
+    watchClient.stop();
+  return httpCode;
 }
 
-static unsigned long lastTelemetryMs = 0;
+// Connects watchClient to API_BASE_URL, a plain http:// URL. TCP keep-alive
+// keeps the NAT mapping of the idle long poll and notices a server that went
+// away in the meantime.
+bool watchConnect() {
+  const char *host = API_BASE_URL + strlen("http://");
+  const char *colon = strchr(host, ':');
+  char name[64];
+  strlcpy(name, host,
+          colon != nullptr ? std::min(sizeof(name), (size_t)(colon - host + 1))
+                           : sizeof(name));
+  uint16_t port = colon != nullptr ? atoi(colon + 1) : 80;
+  if (!watchClient.connect(name, port))
+    return false;
+
+  int fd = watchClient.fd();
+  int enabled = 1, idle = SCHEDULE_WATCH_KEEPALIVE_S, interval = 10, count = 3;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enabled, sizeof(enabled));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+  return true;
+}
 
-void sendTelemetry(const char *eventType, bool motionDetected) {
-  if (!TELEMETRY)
+// Parses the response straight from the socket without buffering the body.
+// The server sends every scalar field before the "schedule" array, so those
+// are read into a small buffer and parsed first, then each point is
+// deserialized on its own into target.points.
+bool parseJsonSchedule(Stream &stream, int size, LightingSchedule &target) {
+  static char header[SCHEDULE_HEADER_BUFFER_SIZE];
+  size_t limit = sizeof(header) - 2; // room for the closing brace
+  if (size > 0)
+    limit = min(limit, (size_t)size);
+
+  size_t length = stream.readBytesUntil('[', header, limit);
+  header[length] = '\0';
+
+  // Turn `{...,"schedule":` into `{...}`, a device without a profile gets
+  // plain `null` and no array at all
+  char *arrayKey = strstr(header, "\"schedule\":");
+  if (arrayKey != nullptr) {
+    while (arrayKey > header && arrayKey[-1] != ',' && arrayKey[-1] != '{')
+      --arrayKey;
+    if (arrayKey[-1] == ',')
+      --arrayKey;
+    arrayKey[0] = '}';
+    arrayKey[1] = '\0';
+  } else if ((int)length != size) {
+    Serial.println("[ERROR] Schedule header too large");
+    return false;
+  }
+
+  scheduleJsonArena.reset();
+  JsonDocument doc(&scheduleJsonArena);
+  DeserializationError error = deserializeJson(doc, header);
+  if (error) {
+    Serial.print("[ERROR] JSON parsing failed: ");
+    Serial.println(error.c_str());
+    return false;
+  }
+
+  target.profileId = doc["profile_id"];
+  target.sleepStartUtcSeconds = doc["sleep_start_utc_seconds"];
+  target.sleepEndUtcSeconds = doc["sleep_end_utc_seconds"];
+  target.minColorTemp = doc["min_color_temp"];
+  target.maxColorTemp = doc["max_color_temp"];
+  target.nightModeEnabled = doc["night_mode_enabled"];
+  target.motionTimeoutSeconds = doc["motion_timeout_seconds"];
+  target.generatedAt = parseIsoTime(doc["generated_at"]);
+  target.validUntil = parseIsoTime(doc["valid_until"]);
+  target.pointCount = 0;
+
+  if (arrayKey == nullptr)
+    return true;
+
+  int count = 0;
+  do {
+    doc.clear();
+    scheduleJsonArena.reset(); // clear() gave everything back
+    error = deserializeJson(doc, stream);
+    if (error) {
+      Serial.print("[ERROR] JSON point parsing failed: ");
+      Serial.println(error.c_str());
+      return false;
+    }
+
+    // Extra points are still consumed to keep the connection reusable
+    if (count < API_MAX_SCHEDULE_SIZE) {
+      target.points[count].timestamp = parseIsoTime(doc["utc"]);
+      target.points[count].colorTemp = doc["temp"];
+      ++count;
+    }
+  } while (stream.findUntil(",", "]"));
+
+  stream.find("}"); // closing brace of the response object
+  target.pointCount = count;
+  return true;
+}
+
+// Decodes the compact representation, timestamps are a running sum of deltas
+bool parseBinarySchedule(Stream &stream, LightingSchedule &target) {
+  BinaryScheduleHeader header;
+  if (stream.readBytes((uint8_t *)&header, sizeof(header)) != sizeof(header)) {
+    Serial.println("[ERROR] Binary schedule header truncated");
+    return false;
+  }
+  if (header.version != SCHEDULE_BINARY_VERSION) {
+    Serial.print("[ERROR] Unsupported binary schedule version: ");
+    Serial.println(header.version);
+    return false;
+  }
+
+  applyBinaryHeader(header, target);
+
+  time_t timestamp = header.generatedAt;
+  BinarySchedulePoint chunk[16];
+  int remaining = header.pointCount;
+  int count = 0;
+
+  while (remaining > 0) {
+    int chunkCount = min(remaining, (int)(sizeof(chunk) / sizeof(chunk[0])));
+    size_t chunkSize = chunkCount * sizeof(BinarySchedulePoint);
+    if (stream.readBytes((uint8_t *)chunk, chunkSize) != chunkSize) {
+      Serial.println("[ERROR] Binary schedule points truncated");
+      return false;
+    }
+
+    for (int i = 0; i < chunkCount && count < API_MAX_SCHEDULE_SIZE; ++i) {
+      timestamp += chunk[i].deltaSeconds;
+      target.points[count].timestamp = timestamp;
+      target.points[count].colorTemp = chunk[i].colorTemp;
+      ++count;
+    }
+    remaining -= chunkCount;
+  }
+
+  target.pointCount = count;
+  return true;
+}
+
+void applyBinaryHeader(const BinaryScheduleHeader &header,
+                       LightingSchedule &target) {
+  target.profileId = header.profileId;
+  target.sleepStartUtcSeconds = header.sleepStartUtcSeconds;
+  target.sleepEndUtcSeconds = header.sleepEndUtcSeconds;
+  target.minColorTemp = header.minColorTemp;
+  target.maxColorTemp = header.maxColorTemp;
+  target.nightModeEnabled = header.flags & 0x01;
+  target.motionTimeoutSeconds = header.motionTimeoutSeconds;
+  target.generatedAt = header.generatedAt;
+  target.validUntil = header.validUntil;
+  target.pointCount = 0;
+}
+
+// NVS key of a slot, slot 0 keeps the names from before zones existed
+static void scheduleKey(char *key, size_t size, const char *name, int slot) {
+  if (slot == 0)
+    strlcpy(key, name, size);
+  else
+    snprintf(key, size, "%s%d", name, slot);
+}
+
+// Stored in the binary wire layout, a new blob is only written when the
+// server sent a different schedule, a 304 leaves flash alone
+void saveSchedule(int slot, const LightingSchedule &source) {
+  struct __attribute__((packed)) {
+    BinaryScheduleHeader header;
+    BinarySchedulePoint points[API_MAX_SCHEDULE_SIZE];
+  } blob;
+
+  blob.header.version = SCHEDULE_BINARY_VERSION;
+  blob.header.flags = source.nightModeEnabled ? 0x01 : 0x00;
+  blob.header.pointCount = source.pointCount;
+  blob.header.profileId = source.profileId;
+  blob.header.sleepStartUtcSeconds = source.sleepStartUtcSeconds;
+  blob.header.sleepEndUtcSeconds = source.sleepEndUtcSeconds;
+  blob.header.minColorTemp = source.minColorTemp;
+  blob.header.maxColorTemp = source.maxColorTemp;
+  blob.header.motionTimeoutSeconds = source.motionTimeoutSeconds;
+  blob.header.generatedAt = source.generatedAt;
+  blob.header.validUntil = source.validUntil;
+
+  time_t previous = source.generatedAt;
+  for (int i = 0; i < source.pointCount; ++i) {
+    time_t delta = source.points[i].timestamp - previous;
+    if (delta < 0 || delta > UINT16_MAX) {
+      Serial.println("[WARN] Schedule does not fit the stored layout");
+      return;
+    }
+    blob.points[i].deltaSeconds = delta;
+    blob.points[i].colorTemp = source.points[i].colorTemp;
+    previous = source.points[i].timestamp;
+  }
+
+  char blobKey[8], etagKey[8];
+  scheduleKey(blobKey, sizeof(blobKey), "blob", slot);
+  scheduleKey(etagKey, sizeof(etagKey), "etag", slot);
+
+  size_t size = sizeof(blob.header) + source.pointCount * sizeof(blob.points[0]);
+  if (schedulePreferences.putBytes(blobKey, &blob, size) != size)
+    Serial.println("[WARN] Could not store schedule");
+  schedulePreferences.putString(etagKey, source.etag);
+}
+
+void restoreSchedules() {
+  // Stays open, saveSchedule() writes through the same handle
+  if (!schedulePreferences.begin("schedule", false))
     return;
 
-  if (millis() - lastTelemetryMs < TELEMETRY_DEBOUNCE_MS)
+  for (int slot = 0; slot < SCHEDULE_SLOT_COUNT; ++slot)
+    restoreSchedule(slot, pendingSchedules[slot]);
+}
+
+// Loads the blob written by saveSchedule() and marks it ready to apply
+bool restoreSchedule(int slot, LightingSchedule &target) {
+  char blobKey[8], etagKey[8];
+  scheduleKey(blobKey, sizeof(blobKey), "blob", slot);
+  scheduleKey(etagKey, sizeof(etagKey), "etag", slot);
+
+  struct __attribute__((packed)) {
+    BinaryScheduleHeader header;
+    BinarySchedulePoint points[API_MAX_SCHEDULE_SIZE];
+  } blob;
+
+  size_t size = schedulePreferences.getBytes(blobKey, &blob, sizeof(blob));
+  if (size < sizeof(blob.header) ||
+      blob.header.version != SCHEDULE_BINARY_VERSION ||
+      size != sizeof(blob.header) +
+                  blob.header.pointCount * sizeof(blob.points[0])) {
+    Serial.println("[INIT] No stored schedule");
+    return false;
+  }
+
+  applyBinaryHeader(blob.header, target);
+
+  time_t timestamp = blob.header.generatedAt;
+  for (int i = 0; i < blob.header.pointCount; ++i) {
+    timestamp += blob.points[i].deltaSeconds;
+    target.points[i].timestamp = timestamp;
+    target.points[i].colorTemp = blob.points[i].colorTemp;
+  }
+  target.pointCount = blob.header.pointCount;
+
+  indexSchedule(target);
+  if (schedulePreferences.getString(etagKey, target.etag, sizeof(target.etag)) == 0)
+    target.etag[0] = '\0';
+  pendingScheduleStatus[slot] = SCHEDULE_READY;
+
+  Serial.print("[INIT] Restored stored schedule of profile ");
+  Serial.println((long)target.profileId);
+  return true;
+}
+
+// Swaps in what the last fetch produced, never waits for a fetch in progress
+void applyPendingSchedule() {
+  bool pending = false;
+  for (int slot = 0; slot < SCHEDULE_SLOT_COUNT; ++slot)
+    pending |= pendingScheduleStatus[slot] != SCHEDULE_NONE;
+  if (!pending || xSemaphoreTake(pendingScheduleMutex, 0) != pdTRUE)
     return;
-  lastTelemetryMs = millis();
 
-  if (WiFi.status() != WL_CONNECTED)
+  for (int slot = 0; slot < SCHEDULE_SLOT_COUNT; ++slot) {
+    if (pendingScheduleStatus[slot] == SCHEDULE_READY) {
+      schedules[slot] = pendingSchedules[slot];
+      state.scheduleLoaded[slot] = true;
+      state.scheduleExpiredWarned[slot] = false;
+    }
+    pendingScheduleStatus[slot] = SCHEDULE_NONE;
+  }
+
+  xSemaphoreGive(pendingScheduleMutex);
+}
+
+// Parse an ISO8601 UTC timestamp, fractional seconds are ignored
+time_t parseIsoTime(const char *str) {
+  if (str == nullptr)
+    return 0;
+
+  struct tm tm = {};
+  strptime(str, "%Y-%m-%dT%H:%M:%S", &tm);
+  return mktime(&tm);
+}
+
+void setupTelemetry() {
+  if (!TELEMETRY)
     return;
 
-  Serial.print("[Telemetry] Sending event: ");
-  Serial.println(eventType);
+  telemetrySpoolBegin();
+  telemetryQueue = xQueueCreate(TELEMETRY_QUEUE_LENGTH, sizeof(SpooledEvent));
+  telemetryFlushed = xSemaphoreCreateBinary();
+  if (telemetryQueue == nullptr || telemetryFlushed == nullptr ||
+      xTaskCreate(telemetryTask, "telemetry", NETWORK_TASK_STACK_SIZE, nullptr,
+                  NETWORK_TASK_PRIORITY, &telemetryTaskHandle) != pdPASS) {
+    Serial.println("[ERROR] Could not start telemetry task");
+    telemetryQueue = nullptr;
+    return;
+  }
+  Serial.println("[INIT] Telemetry task started");
+}
 
-  HTTPClient http;
-  String url = String(API_BASE_URL) + API_TELEMETRY_ROUTE;
+// Only enqueues the event, the HTTP request is made by telemetryTask. Events
+// are reported as the device, `zone` only provides the light state.
+void sendTelemetry(TelemetryEventType type, const ZoneState &zone,
+                   bool motionDetected) {
+  if (!TELEMETRY || telemetryQueue == nullptr)
+    return;
 
-  http.begin(url);
-  http.addHeader("Content-Type", "application/json");
-  http.addHeader(API_KEY_HEADER, currentApiKey);
+  uint32_t perf = perfStart();
 
-  JsonDocument doc;
-  doc["event_type"] = eventType;
-  doc["motion_detected"] = motionDetected;
-  doc["light_is_on"] = state.lightIsOn;
-  doc["brightness"] = state.currentBrightnessPercent;
+  SpooledEvent event;
+  event.type = type;
+  event.flags = (motionDetected ? SPOOLED_MOTION_DETECTED : 0) |
+                (zone.lightIsOn ? SPOOLED_LIGHT_IS_ON : 0);
+  if (state.time.synced) {
+    event.time = state.time.now;
+  } else {
+    // Resolved by the spool once the clock is synced
+    event.time = millis() / 1000;
+    event.flags |= SPOOLED_TIME_UPTIME;
+  }
+  event.brightnessPercent = state.currentBrightnessPercent;
+  event.colorTemp = zone.currentColorTemp;
 
-  if (state.currentColorTemp >= API_MIN_TEMP_CONSTRAINT_K) {
-    doc["color_temp"] = state.currentColorTemp;
+  if (xQueueSend(telemetryQueue, &event, 0) != pdTRUE) {
+    Serial.print("[Telemetry] Queue full, dropping event: ");
+    Serial.println(TELEMETRY_EVENT_NAMES[type]);
   }
+  perfStop(PERF_SEND_TELEMETRY, perf);
+}
+
+// Uploads pending events right away, e.g. before a reboot. What cannot be
+// sent is kept in NVS for the next boot.
+void flushTelemetry() {
+  if (!TELEMETRY || telemetryQueue == nullptr)
+    return;
+
+  SpooledEvent marker = {};
+  marker.type = TELEMETRY_FLUSH_MARKER;
+  xSemaphoreTake(telemetryFlushed, 0);
+  if (xQueueSend(telemetryQueue, &marker, pdMS_TO_TICKS(TELEMETRY_FLUSH_TIMEOUT_MS)) ==
+      pdTRUE)
+    xSemaphoreTake(telemetryFlushed, pdMS_TO_TICKS(TELEMETRY_FLUSH_TIMEOUT_MS));
+}
+
+// Moves events into the spool and uploads it in batches, when a batch is
+// full, when the oldest event is TELEMETRY_FLUSH_INTERVAL_MS old (less the
+// device's jitter), or when flushTelemetry() asks. Failed or offline uploads
+// are retried with backoff, the spool keeps the events meanwhile.
+void telemetryTask(void *parameter) {
+  static SpooledEvent batch[TELEMETRY_BATCH_SIZE];
+  RefreshTimer retry; // Of failed uploads, also draws the flush jitter
+  refreshBegin(retry, refreshSeed(currentApiKey.c_str()), millis());
+  unsigned long pendingSinceMs = millis();
+  unsigned long flushAfterMs =
+      TELEMETRY_FLUSH_INTERVAL_MS - refreshJitterMs(retry, TELEMETRY_FLUSH_JITTER_MS);
+  bool waitingForWiFi = false; // Retry as soon as it is back
+  SpooledEvent event;
+
+  for (;;) {
+    bool pending = telemetrySpoolBuffered() > 0 || telemetrySpoolHasBacklog();
+    unsigned long now = millis();
+    unsigned long dueMs = now;
+
+    if (pending) {
+      if (telemetrySpoolBuffered() < TELEMETRY_BATCH_SIZE &&
+          !telemetrySpoolHasBacklog())
+        dueMs = pendingSinceMs + flushAfterMs;
+      // The whole fleet reconnects at once, its backlogs are spread
+      if (waitingForWiFi && retry.backoffMs > 0 && WiFi.status() == WL_CONNECTED)
+        refreshWithin(retry, now, FLEET_SPREAD_MS);
+      if (retry.backoffMs > 0 && (long)(retry.dueMs - dueMs) > 0)
+        dueMs = retry.dueMs;
+    }
+    telemetryUploadDueMs = dueMs;
+    telemetryUploadPending = pending;
+
+    TickType_t wait = portMAX_DELAY;
+    if (pending)
+      wait = (long)(dueMs - now) > 0 ? pdMS_TO_TICKS(dueMs - now) : 0;
 
-  String jsonPayload;
-  serializeJson(doc, jsonPayload);
+    bool received = xQueueReceive(telemetryQueue, &event, wait) == pdTRUE;
+    bool flushRequested = received && event.type == TELEMETRY_FLUSH_MARKER;
 
-  int httpCode = http.POST(jsonPayload);
+    if (received && !flushRequested) {
+      if (!pending) {
+        pendingSinceMs = millis();
+        flushAfterMs = TELEMETRY_FLUSH_INTERVAL_MS -
+                       refreshJitterMs(retry, TELEMETRY_FLUSH_JITTER_MS);
+      }
+      telemetrySpoolPush(event);
+      continue;
+    }
+
+    now = millis();
+    bool uploadDue = flushRequested || (pending && (long)(now - dueMs) >= 0);
+    if (!uploadDue)
+      continue;
+
+    // A flush has a deadline, one batch and the rest goes to NVS
+    bool online = WiFi.status() == WL_CONNECTED && !apiUnauthorized;
+    int count;
+    while (online && (count = telemetrySpoolPeek(batch, TELEMETRY_BATCH_SIZE)) > 0) {
+      unsigned long startUs = micros();
+      bool posted = postTelemetryBatch(batch, count);
+      perfRecordUs(PERF_TELEMETRY_UPLOAD, micros() - startUs);
+      if (!posted) {
+        online = false;
+        break;
+      }
+      telemetrySpoolPop(count);
+      retry.backoffMs = 0;
+      if (flushRequested)
+        break;
+    }
+
+    waitingForWiFi = WiFi.status() != WL_CONNECTED;
+    if (!online && pending)
+      refreshFailed(retry, millis(), TELEMETRY_RETRY_MIN_MS, TELEMETRY_RETRY_MAX_MS);
+    pendingSinceMs = millis();
+    flushAfterMs = TELEMETRY_FLUSH_INTERVAL_MS -
+                   refreshJitterMs(retry, TELEMETRY_FLUSH_JITTER_MS);
+
+    if (flushRequested) {
+      telemetrySpoolPersist();
+      xSemaphoreGive(telemetryFlushed);
+    }
+  }
+}
+
+// Returns the HTTP code, or 0 if the request could not be started
+int postTelemetryPayload(const char *contentType, const uint8_t *payload,
+                         size_t length) {
+  if (!apiBegin(API_BASE_URL API_TELEMETRY_BATCH_ROUTE))
+    return 0;
+  apiHttp.addHeader("Content-Type", contentType);
+
+  int httpCode = apiSend("POST", (uint8_t *)payload, length);
+  apiDrain();
+  apiEnd();
+  return httpCode;
+}
 
+// Returns whether the batch is done with, sent or not worth retrying
+bool telemetryBatchDone(int httpCode) {
   if (httpCode == HTTP_CODE_UNAUTHORIZED) {
     Serial.println("[ERROR] 401 Unauthorized. API Key invalid.");
-    enterConfigMode();
+    // Config mode runs the web server, leave it to loop()
+    apiUnauthorized = true;
   } else if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_CREATED) {
     Serial.println("[Telemetry] Sent successfully");
-  } else {
+    return true;
+  } else if (httpCode == HTTP_CODE_BAD_REQUEST ||
+             httpCode == HTTP_CODE_UNPROCESSABLE_ENTITY) {
+    // Retrying would only block the spool behind it
+    Serial.print("[Telemetry] Rejected with code: ");
+    Serial.println(httpCode);
+    return true;
+  } else if (httpCode != 0) {
     Serial.print("[Telemetry] Failed with code: ");
     Serial.println(httpCode);
   }
+  return false;
+}
+
+// Returns whether the server took the batch
+bool postTelemetryBatch(const SpooledEvent *events, int count) {
+  Serial.print("[Telemetry] Sending ");
+  Serial.print(count);
+  Serial.println(" events");
+
+  // Servers without the binary route answer 415 or 400, those get JSON for
+  // TELEMETRY_BINARY_RETRY_MS. A batch refused for its content, or an
+  // upgraded server, is then tried in binary again.
+  static bool binaryRejected = false;
+  static unsigned long binaryRejectedMs = 0;
+  if (binaryRejected && millis() - binaryRejectedMs >= TELEMETRY_BINARY_RETRY_MS)
+    binaryRejected = false;
+  if (TELEMETRY_BINARY && !binaryRejected) {
+    static uint8_t binaryPayload[TELEMETRY_BINARY_PAYLOAD_SIZE];
+    size_t length = encodeTelemetryBatch(events, count, TELEMETRY_EVENT_TYPE_COUNT,
+                                         binaryPayload, sizeof(binaryPayload));
+    if (length > 0) {
+      int httpCode =
+          postTelemetryPayload(TELEMETRY_BINARY_CONTENT_TYPE, binaryPayload, length);
+      if (httpCode != HTTP_CODE_BAD_REQUEST &&
+          httpCode != HTTP_CODE_UNSUPPORTED_MEDIA_TYPE)
+        return telemetryBatchDone(httpCode);
+      Serial.print("[Telemetry] Binary batch rejected with code: ");
+      Serial.print(httpCode);
+      Serial.println(", using JSON");
+      binaryRejected = true;
+      binaryRejectedMs = millis();
+    }
+  }
+
+  static char payload[TELEMETRY_PAYLOAD_SIZE];
+  telemetryJsonArena.reset();
+  JsonDocument doc(&telemetryJsonArena);
+  JsonArray array = doc.to<JsonArray>();
+
+  for (int i = 0; i < count; ++i) {
+    const SpooledEvent &event = events[i];
+    if (event.type >= TELEMETRY_EVENT_TYPE_COUNT)
+      continue; // Corrupted in NVS
+    JsonObject entry = array.add<JsonObject>();
+
+    entry["event_type"] = TELEMETRY_EVENT_NAMES[event.type];
+    entry["motion_detected"] = (bool)(event.flags & SPOOLED_MOTION_DETECTED);
+    entry["light_is_on"] = (bool)(event.flags & SPOOLED_LIGHT_IS_ON);
+    entry["brightness"] = event.brightnessPercent;
 
-  http.end();
+    if (event.colorTemp >= API_MIN_TEMP_CONSTRAINT_K) {
+      entry["color_temp"] = event.colorTemp;
+    }
+    // Still relative to boot if the clock never synced, the server uses its own
+    if (event.time != 0 && !(event.flags & SPOOLED_TIME_UPTIME)) {
+      entry["timestamp"] = event.time;
+    }
+  }
+
+  // Only if the sizes above are wrong, retrying would not help
+  if (doc.overflowed() || measureJson(doc) >= sizeof(payload)) {
+    Serial.println("[ERROR] Telemetry batch too large, dropped");
+    return true;
+  }
+  size_t payloadLength = serializeJson(doc, payload, sizeof(payload));
+
+  return telemetryBatchDone(
+      postTelemetryPayload("application/json", (uint8_t *)payload, payloadLength));
 }
 
 void enterConfigMode() {
@@ -338,195 +1475,482 @@ void enterConfigMode() {
     return;
 
   isInConfigMode = true;
-
-  // Visual cue with red light to indicate error/attention needed
-  state.lightIsOn = true;
-  state.currentColorTemp = MIN_COLOR_TEMP_K;
-  state.currentBrightnessPercent = 50;
-  updateLighting();
+  // inputTask shows the cue, it owns the device state
+  if (inputTaskHandle != nullptr)
+    xTaskNotifyGive(inputTaskHandle);
 
   Serial.println("\n!!! ENTERING CONFIGURATION MODE !!!");
   Serial.print("Please connect to: http://");
   Serial.println(WiFi.localIP());
   Serial.println("Or: http://localhost:8180");
 
-  // Define Web Server Routes
-  server.on("/", HTTP_GET, []() {
-    String html = "<html><body><h1>LumiRum Device Config</h1>";
-    html += "<p>Device is unauthorized. Please update API Key.</p>";
-    html += "<form action='/save' method='POST'>";
-    html += "API Key: <input type='text' name='apikey' size='70'><br><br>";
-    html += "<input type='submit' value='Save & Reboot'>";
-    html += "</form></body></html>";
-    server.send(HTTP_CODE_OK, "text/html", html);
-  });
-
-  server.on("/save", HTTP_POST, []() {
-    if (server.hasArg("apikey")) {
-      String newKey = server.arg("apikey");
-      newKey.trim();
-
-      if (newKey.length() == API_KEY_LENGTH) {
-        preferences.putString("apikey", newKey);
-        server.send(HTTP_CODE_OK, "text/html",
-                    "<body>Saved! Rebooting...</body>");
-        delay(1000);
-        ESP.restart();
-      } else {
-        server.send(HTTP_CODE_BAD_REQUEST, "text/html",
-                    "<body>Invalid Key Length</body>");
-      }
-    } else {
-      server.send(HTTP_CODE_BAD_REQUEST, "text/plain", "Missing apikey");
-    }
-  });
+  httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+  config.server_port = WEB_SERVER_PORT;
+  config.stack_size = PORTAL_TASK_STACK_SIZE;
+  config.task_priority = NETWORK_TASK_PRIORITY;
+  if (httpd_start(&portalServer, &config) != ESP_OK) {
+    Serial.println("[ERROR] Could not start config portal");
+    return;
+  }
 
-  server.begin();
+  httpd_uri_t page = {};
+  page.uri = "/";
+  page.method = HTTP_GET;
+  page.handler = onPortalPage;
+  httpd_register_uri_handler(portalServer, &page);
+
+  httpd_uri_t save = {};
+  save.uri = "/save";
+  save.method = HTTP_POST;
+  save.handler = onPortalSave;
+  httpd_register_uri_handler(portalServer, &save);
 }
 
-int getCurrentColorTemp() {
-  if (!state.scheduleLoaded || schedule.pointCount == 0)
-    return DEFAULT_COLOR_TEMP_K;
+// Sent straight from flash, every browser takes gzip
+esp_err_t onPortalPage(httpd_req_t *request) {
+  httpd_resp_set_type(request, "text/html");
+  httpd_resp_set_hdr(request, "Content-Encoding", "gzip");
+  return httpd_resp_send(request, (const char *)CONFIG_PAGE_GZ,
+                         sizeof(CONFIG_PAGE_GZ));
+}
 
-  time_t now = time(nullptr);
+esp_err_t onPortalSave(httpd_req_t *request) {
+  // apikey=<key>, anything longer is not a valid form
+  char body[CONFIG_FORM_SIZE];
+  if (request->content_len >= sizeof(body))
+    return httpd_resp_send_err(request, HTTPD_400_BAD_REQUEST, "Invalid form");
+
+  size_t length = 0;
+  while (length < request->content_len) {
+    int read = httpd_req_recv(request, body + length,
+                              request->content_len - length);
+    if (read == HTTPD_SOCK_ERR_TIMEOUT)
+      continue;
+    if (read <= 0)
+      return ESP_FAIL; // Closes the connection
+    length += read;
+  }
+  body[length] = '\0';
+
+  char value[CONFIG_FORM_SIZE];
+  if (httpd_query_key_value(body, "apikey", value, sizeof(value)) != ESP_OK)
+    return httpd_resp_send_err(request, HTTPD_400_BAD_REQUEST, "Missing apikey");
+
+  // Form encoding turns surrounding spaces into '+', keys are alphanumeric
+  char *key = value;
+  while (*key == '+')
+    ++key;
+  size_t keyLength = strlen(key);
+  while (keyLength > 0 && key[keyLength - 1] == '+')
+    key[--keyLength] = '\0';
+
+  httpd_resp_set_type(request, "text/html");
+  if (keyLength != API_KEY_LENGTH) {
+    httpd_resp_set_status(request, "400 Bad Request");
+    return httpd_resp_send(request, CONFIG_INVALID_KEY_HTML,
+                           sizeof(CONFIG_INVALID_KEY_HTML) - 1);
+  }
 
-  if (schedule.nightModeEnabled && isNightTime())
-    return MIN_COLOR_TEMP_K;
+  preferences.putString("apikey", key);
+  httpd_resp_send(request, CONFIG_SAVED_HTML, sizeof(CONFIG_SAVED_HTML) - 1);
+  flushTelemetry();
+  delay(1000);
+  ESP.restart();
+  return ESP_OK;
+}
+
+int getCurrentColorTemp(int zone) {
+  int slot = zoneScheduleSlot(zone);
+  if (!state.scheduleLoaded[slot])
+    return DEFAULT_COLOR_TEMP_K;
 
-  if (now > schedule.validUntil && !state.scheduleExpiredWarned) {
+  LightingSchedule &schedule = schedules[slot];
+  time_t now = state.time.now;
+  if (schedule.dayPointCount > 0 && state.time.synced &&
+      now > schedule.validUntil && !state.scheduleExpiredWarned[slot]) {
     Serial.println("[WARN] Schedule expired, using cyclic lookup");
-    state.scheduleExpiredWarned = true;
+    state.scheduleExpiredWarned[slot] = true;
   }
 
-  // Get time of day for cyclic lookup
-  struct tm timeinfo;
-  gmtime_r(&now, &timeinfo);
-  uint32_t currentDaySeconds =
-      timeinfo.tm_hour * 3600 + timeinfo.tm_min * 60 + timeinfo.tm_sec;
+  return scheduleColorTemp(schedule, now);
+}
 
-  // Find matching points by time of day (cyclic)
-  for (int i = 0; i < schedule.pointCount - 1; ++i) {
-    struct tm tm1, tm2;
-    gmtime_r(&schedule.points[i].timestamp, &tm1);
-    gmtime_r(&schedule.points[i + 1].timestamp, &tm2);
+unsigned long motionTimeoutMs(int zone) {
+  return (unsigned long)schedules[zoneScheduleSlot(zone)].motionTimeoutSeconds *
+         1000;
+}
 
-    uint32_t daySeconds1 = tm1.tm_hour * 3600 + tm1.tm_min * 60 + tm1.tm_sec;
-    uint32_t daySeconds2 = tm2.tm_hour * 3600 + tm2.tm_min * 60 + tm2.tm_sec;
+// Ticks the time base, the only time() call of inputTask. Motion timeouts run
+// on millis() and are not affected by a clock shift, the schedule lookups
+// recompute their caches on their own.
+void handleTimeJump() {
+  timeBaseTick(state.time, time(nullptr), millis());
+  long jumpSeconds = state.time.jumpSeconds;
+  if (jumpSeconds == 0)
+    return;
 
-    if (currentDaySeconds >= daySeconds1 && currentDaySeconds < daySeconds2) {
-      // Linear interpolation
-      float progress = (float)(currentDaySeconds - daySeconds1) /
-                       (float)(daySeconds2 - daySeconds1);
-      int temp1 = schedule.points[i].colorTemp;
-      int temp2 = schedule.points[i + 1].colorTemp;
+  Serial.print("[Time] Detected time jump of ");
+  Serial.print(jumpSeconds);
+  Serial.println(" seconds");
 
-      return temp1 + (int)(progress * (temp2 - temp1));
-    }
+  // Trigger schedule refresh if time jumped significantly forward
+  if (jumpSeconds > (long)TIME_JUMP_REFETCH_THRESHOLD_SEC) {
+    Serial.println("[Time] Triggering schedule refresh");
+    requestScheduleFetch();
   }
-
-  // Use last point if past all points
-  return schedule.points[schedule.pointCount - 1].colorTemp;
 }
 
-bool isNightTime() {
-  time_t now = time(nullptr);
-  struct tm timeinfo;
-  gmtime_r(&now, &timeinfo);
-  uint32_t secondsSinceMidnight =
-      timeinfo.tm_hour * 3600 + timeinfo.tm_min * 60 + timeinfo.tm_sec;
+void setupInput() {
+  for (int zone = 0; zone < ZONE_COUNT; ++zone)
+    pirLevels[zone] = digitalRead(ZONES[zone].pirPin);
 
-  if (schedule.sleepStartUtcSeconds <= schedule.sleepEndUtcSeconds) {
-    // e.g. 2:00 - 10:00 a.m.
-    return secondsSinceMidnight >= schedule.sleepStartUtcSeconds &&
-           secondsSinceMidnight < schedule.sleepEndUtcSeconds;
-  } else {
-    // e.g. 20:00 - 6:00
-    return secondsSinceMidnight >= schedule.sleepStartUtcSeconds ||
-           secondsSinceMidnight < schedule.sleepEndUtcSeconds;
+  if (xTaskCreate(inputTask, "input", INPUT_TASK_STACK_SIZE, nullptr,
+                  INPUT_TASK_PRIORITY, &inputTaskHandle) != pdPASS) {
+    Serial.println("[ERROR] Could not start input task");
+    return;
   }
+
+  attachInterrupt(digitalPinToInterrupt(PIN_BUTTON), onButtonEdge, FALLING);
+  for (int zone = 0; zone < ZONE_COUNT; ++zone)
+    if (firstZoneOnPin(zone))
+      attachInterruptArg(digitalPinToInterrupt(ZONES[zone].pirPin), onPirEdge,
+                         (void *)(intptr_t)ZONES[zone].pirPin, CHANGE);
+  Serial.println("[INIT] Input task started");
 }
 
-void handleTimeJump() {
-  time_t now = time(nullptr);
-  time_t timeDiff = labs(now - state.lastKnownTimeSeconds);
+// The only writer of `state`, everything that decides what the light does
+void inputTask(void *parameter) {
+  for (;;) {
+    if (isInConfigMode)
+      showConfigModeCue();
+
+    applyPendingSchedule();
+
+    uint32_t perf = perfStart();
+    handleTimeJump();
+    perfStop(PERF_TIME_JUMP, perf);
+    perf = perfStart();
+    handleInputEdges();
+    perfStop(PERF_INPUT_EDGES, perf);
+    perf = perfStart();
+    handleMotion();
+    perfStop(PERF_MOTION, perf);
+    perf = perfStart();
+    handleBrightnessPot();
+    perfStop(PERF_BRIGHTNESS_POT, perf);
+    perf = perfStart();
+    updateLighting();
+    perfStop(PERF_UPDATE_LIGHTING, perf);
+
+    publishState();
+
+    waitForNextEvent();
+  }
+}
 
-  if (timeDiff > schedule.motionTimeoutSeconds) {
-    Serial.print("[Time] Detected time jump of ");
-    Serial.print(timeDiff);
-    Serial.println(" seconds");
+void publishState() {
+  portENTER_CRITICAL(&stateLock);
+  stateSnapshot = state;
+  portEXIT_CRITICAL(&stateLock);
+}
 
-    // Check if light timeout expired during jump
-    if (state.lightIsOn && state.modeAuto) {
-      unsigned long timeSinceMotion =
-          (now - (state.motionLastSeenMs / 1000)) * 1000;
-      if (timeSinceMotion >
-          (unsigned long)schedule.motionTimeoutSeconds * 1000) {
-        Serial.println("[Time] Light timeout expired during time jump");
-        state.lightIsOn = false;
-      }
-    }
+// Consistent copy of the state for tasks other than inputTask
+DeviceState readState() {
+  portENTER_CRITICAL(&stateLock);
+  DeviceState snapshot = stateSnapshot;
+  portEXIT_CRITICAL(&stateLock);
+  return snapshot;
+}
 
-    // Trigger schedule refresh if time jumped significantly forward
-    if (now > state.lastKnownTimeSeconds + TIME_JUMP_REFETCH_THRESHOLD_SEC) {
-      Serial.println("[Time] Triggering schedule refresh");
-      fetchSchedule();
-    }
+// Red flash to indicate error/attention needed, then the light carries on
+// with the last schedules while the portal is open
+void showConfigModeCue() {
+  static bool shown = false;
+  if (shown)
+    return;
+  shown = true;
+
+  DeviceState saved = state;
+  for (ZoneState &zone : state.zones) {
+    zone.lightIsOn = true;
+    zone.currentColorTemp = MIN_COLOR_TEMP_K;
   }
+  state.currentBrightnessPercent = 50;
+  invalidateLighting();
+  updateLighting();
+  publishState();
+
+  // Edges meanwhile wait in the input queue
+  vTaskDelay(pdMS_TO_TICKS(CONFIG_CUE_MS));
 
-  state.lastKnownTimeSeconds = now;
+  for (int zone = 0; zone < ZONE_COUNT; ++zone) {
+    state.zones[zone].lightIsOn = saved.zones[zone].lightIsOn;
+    state.zones[zone].currentColorTemp = saved.zones[zone].currentColorTemp;
+  }
+  state.currentBrightnessPercent = saved.currentBrightnessPercent;
+  updateLighting();
+  publishState();
 }
 
-static bool lastButtonState = HIGH;
-static unsigned long lastButtonPressMs = 0;
+void IRAM_ATTR onButtonEdge() { pushInputEdge(PIN_BUTTON); }
 
-void handleButton() {
-  bool currentButtonState = digitalRead(PIN_BUTTON);
+void IRAM_ATTR onPirEdge(void *pin) { pushInputEdge((intptr_t)pin); }
 
-  if (currentButtonState == LOW && lastButtonState == HIGH &&
-      millis() - lastButtonPressMs > BUTTON_DEBOUNCE_MS) {
-    state.modeAuto = !state.modeAuto;
+void IRAM_ATTR pushInputEdge(uint8_t pin) {
+  uint32_t head = inputHead.load(std::memory_order_relaxed);
 
-    Serial.print("[Button] Mode switched to: ");
-    Serial.println(state.modeAuto ? "AUTO" : "MANUAL");
+  if (head - inputTail.load(std::memory_order_acquire) >= INPUT_QUEUE_LENGTH) {
+    inputOverflow.store(true, std::memory_order_relaxed);
+  } else {
+    InputEdge &edge = inputEdges[head % INPUT_QUEUE_LENGTH];
+    edge.pin = pin;
+    edge.level = digitalRead(pin);
+    edge.micros = micros();
+    inputHead.store(head + 1, std::memory_order_release);
+  }
 
-    if (state.modeAuto) {
-      state.lightIsOn = false;
-    } else {
-      state.lightIsOn = true;
-      state.currentColorTemp = DEFAULT_COLOR_TEMP_K;
-    }
+  BaseType_t woken = pdFALSE;
+  if (inputTaskHandle != nullptr)
+    vTaskNotifyGiveFromISR(inputTaskHandle, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+
+void handleInputEdges() {
+  uint32_t tail = inputTail.load(std::memory_order_relaxed);
+  uint32_t head = inputHead.load(std::memory_order_acquire);
 
-    sendTelemetry("mode_change", false);
-    lastButtonPressMs = millis();
+  for (; tail != head; ++tail) {
+    InputEdge edge = inputEdges[tail % INPUT_QUEUE_LENGTH];
+    inputTail.store(tail + 1, std::memory_order_release);
+
+    if (edge.pin == PIN_BUTTON)
+      handleButtonEdge(edge.level, edge.micros);
+    else
+      handlePirEdge(edge.pin, edge.level, edge.micros);
   }
 
-  lastButtonState = currentButtonState;
+  // Lost edges, fall back to the current pin levels
+  if (inputOverflow.exchange(false, std::memory_order_relaxed)) {
+    Serial.println("[Input] Edge queue overflow");
+    for (int zone = 0; zone < ZONE_COUNT; ++zone)
+      pirLevels[zone] = digitalRead(ZONES[zone].pirPin);
+  }
 }
 
-void handleMotion() {
-  if (!state.modeAuto)
+// Every edge goes into the occupancy filters of the zones bound to `pin`,
+// handleMotion() decides what they mean
+void handlePirEdge(uint8_t pin, uint8_t level, uint32_t edgeUs) {
+  // At the edge, not when we got around to it
+  unsigned long edgeMs = millis() - (micros() - edgeUs) / 1000;
+
+  for (int zone = 0; zone < ZONE_COUNT; ++zone) {
+    if (ZONES[zone].pirPin != pin)
+      continue;
+    occupancySample(state.zones[zone].occupancy, level == HIGH, edgeMs);
+    pirLevels[zone] = level;
+  }
+}
+
+// Contact bounce shows up as a burst of falling edges, only the first one per
+// BUTTON_DEBOUNCE_MS counts
+void handleButtonEdge(uint8_t level, uint32_t edgeUs) {
+  if (level != LOW || (buttonPressedOnce &&
+                       edgeUs - lastButtonPressUs <= BUTTON_DEBOUNCE_MS * 1000))
     return;
 
-  bool motionDetected = digitalRead(PIN_PIR_SENSOR);
+  buttonPressedOnce = true;
+  lastButtonPressUs = edgeUs;
+  handleButtonPress();
+}
 
-  if (motionDetected) {
-    if (!state.lightIsOn) {
-      Serial.println("[Motion] Detected - turning light ON");
-      sendTelemetry("motion_detected", true);
-    }
+void handleButtonPress() {
+  state.modeAuto = !state.modeAuto;
+
+  Serial.print("[Button] Mode switched to: ");
+  Serial.println(state.modeAuto ? "AUTO" : "MANUAL");
+
+  setAllZonesOn(!state.modeAuto);
+  for (ZoneState &zone : state.zones) {
+    if (state.modeAuto)
+      occupancyClear(zone.occupancy); // The light is off, so is the room
+    else
+      zone.currentColorTemp = DEFAULT_COLOR_TEMP_K;
+  }
+
+  sendTelemetry(TELEMETRY_MODE_CHANGE, state.zones[0], false);
+}
 
-    state.lightIsOn = true;
-    state.motionLastSeenMs = millis();
-    state.currentColorTemp = getCurrentColorTemp();
+void setAllZonesOn(bool on) {
+  for (ZoneState &zone : state.zones)
+    zone.lightIsOn = on;
+}
+
+// Blocks until an input edge or the next deadline, in light sleep when
+// offline and nothing else is running
+void waitForNextEvent() {
+  // An edge arrived while this iteration was running
+  if (ulTaskNotifyTake(pdTRUE, 0) > 0)
+    return;
+
+  unsigned long waitMs = untilNextDeadlineMs(millis());
+
+  if (LIGHT_SLEEP_ENABLED && waitMs >= LIGHT_SLEEP_MIN_MS && canLightSleep()) {
+    lightSleep(waitMs);
     return;
   }
 
-  if (state.lightIsOn &&
-      (millis() - state.motionLastSeenMs >
-       (unsigned long)schedule.motionTimeoutSeconds * 1000)) {
-    Serial.println("[Motion] Timeout - turning light OFF");
-    state.lightIsOn = false;
-    sendTelemetry("motion_timeout", false);
+  // At least a tick, an overdue deadline of a lower priority task must not
+  // keep this one spinning
+  ulTaskNotifyTake(pdTRUE, std::max(pdMS_TO_TICKS(waitMs), (TickType_t)1));
+}
+
+static unsigned long remainingMs(unsigned long sinceMs, unsigned long intervalMs,
+                                 unsigned long nowMs) {
+  unsigned long elapsed = nowMs - sinceMs;
+  return elapsed >= intervalMs ? 0 : intervalMs - elapsed;
+}
+
+unsigned long untilNextDeadlineMs(unsigned long nowMs) {
+  bool anyLightOn = false;
+  for (const ZoneState &zone : state.zones)
+    anyLightOn |= zone.lightIsOn;
+
+  // The pot is polled, so it sets the pace whenever it can change the light
+  unsigned long waitMs =
+      state.modeAuto && !anyLightOn ? IDLE_SLEEP_MAX_MS : LOOP_DELAY_MS;
+
+  for (int zone = 0; zone < ZONE_COUNT && state.modeAuto; ++zone) {
+    const OccupancyFilter &occupancy = state.zones[zone].occupancy;
+    if (occupancy.motion && !occupancy.occupied)
+      waitMs = std::min(waitMs, OCCUPANCY_SLOT_MS); // Confirm the arrival
+    else if (occupancy.occupied && !occupancy.motion)
+      waitMs = std::min(
+          waitMs, remainingMs(occupancy.lastMotionMs,
+                              occupancyTimeoutMs(occupancy, motionTimeoutMs(zone)),
+                              nowMs));
+  }
+
+  if (telemetryUploadPending)
+    waitMs = std::min(waitMs, (long)(telemetryUploadDueMs - nowMs) > 0
+                                  ? telemetryUploadDueMs - nowMs
+                                  : 0);
+
+  // Wake up for the next schedule fetch, networkTask runs it
+  if (connectionState == CONNECTION_ONLINE && !apiUnauthorized)
+    waitMs = std::min(waitMs, (long)(scheduleRefreshDueMs - nowMs) > 0
+                                  ? scheduleRefreshDueMs - nowMs
+                                  : 0);
+
+  // Wake up for the next reconnect attempt
+  if (connectionState == CONNECTION_WAITING)
+    waitMs = std::min(waitMs, (long)(connectionDeadlineMs - nowMs) > 0
+                                  ? connectionDeadlineMs - nowMs
+                                  : 0);
+
+  return waitMs;
+}
+
+// Light sleep stops every task, so only when none of them has work left and
+// WiFi is down between reconnect attempts
+bool canLightSleep() {
+  for (bool level : pirLevels)
+    if (level == HIGH)
+      return false; // The level wakeup would fire right away
+  if (digitalRead(PIN_BUTTON) == LOW)
+    return false;
+
+  if (scheduleFetchRequested ||
+      (apiMutex != nullptr && xSemaphoreGetMutexHolder(apiMutex) != nullptr))
+    return false; // Request pending or in flight
+
+  // A manual light sleep powers down the radio and IDF does not keep the
+  // association through it, which would also drop the watch long poll and
+  // portal sockets. Online the radio uses modem sleep between beacons instead.
+  if (connectionState != CONNECTION_WAITING || connectionChanged)
+    return false;
+
+  if (isInConfigMode)
+    return false; // The portal answers right away
+
+  if (telemetryQueue != nullptr && uxQueueMessagesWaiting(telemetryQueue) > 0)
+    return false;
+
+  ZoneFrame frames[ZONE_COUNT];
+  portENTER_CRITICAL(&transitionLock);
+  bool fading = sampleTransitions(millis(), frames);
+  portEXIT_CRITICAL(&transitionLock);
+
+  return !fading && !rendered.dithering; // Frames of a dim light keep coming
+}
+
+void lightSleep(unsigned long durationMs) {
+  // Level wakeups replace the edge interrupt types, restored below
+  for (const ZoneConfig &zone : ZONES)
+    gpio_wakeup_enable((gpio_num_t)zone.pirPin, GPIO_INTR_HIGH_LEVEL);
+  gpio_wakeup_enable((gpio_num_t)PIN_BUTTON, GPIO_INTR_LOW_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+  uart_set_wakeup_threshold(UART_NUM_0, 3); // Serial commands
+  esp_sleep_enable_uart_wakeup(UART_NUM_0);
+  esp_sleep_enable_timer_wakeup((uint64_t)durationMs * 1000);
+
+  Serial.flush();
+  esp_light_sleep_start();
+
+  for (const ZoneConfig &zone : ZONES) {
+    gpio_wakeup_disable((gpio_num_t)zone.pirPin);
+    gpio_set_intr_type((gpio_num_t)zone.pirPin, GPIO_INTR_ANYEDGE);
+  }
+  gpio_wakeup_disable((gpio_num_t)PIN_BUTTON);
+  gpio_set_intr_type((gpio_num_t)PIN_BUTTON, GPIO_INTR_NEGEDGE);
+
+  // The edge that woke us happened while the ISRs were not armed
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO) {
+    for (int zone = 0; zone < ZONE_COUNT; ++zone)
+      pirLevels[zone] = digitalRead(ZONES[zone].pirPin);
+    handleButtonEdge(digitalRead(PIN_BUTTON), micros());
+  }
+
+  // The tick count does not advance in light sleep, let the network tasks
+  // recompute their timeouts from millis()
+  if (telemetryTaskHandle != nullptr)
+    xTaskAbortDelay(telemetryTaskHandle);
+  if (networkTaskHandle != nullptr)
+    xTaskAbortDelay(networkTaskHandle);
+  if (watchTaskHandle != nullptr)
+    xTaskAbortDelay(watchTaskHandle);
+}
+
+void handleMotion() {
+  if (!state.modeAuto)
+    return;
+
+  unsigned long nowMs = millis();
+  for (int zone = 0; zone < ZONE_COUNT; ++zone) {
+    ZoneState &zoneState = state.zones[zone];
+
+    // Single glitches never get past the filter, only real arrivals and
+    // departures switch the light and are reported
+    switch (occupancyUpdate(zoneState.occupancy, pirLevels[zone] == HIGH, nowMs,
+                            motionTimeoutMs(zone))) {
+    case OCCUPANCY_ARRIVED:
+      Serial.print("[Motion] Detected - turning light ON, zone ");
+      Serial.println(zone);
+      sendTelemetry(TELEMETRY_MOTION_DETECTED, zoneState, true);
+      zoneState.lightIsOn = true;
+      zoneState.currentColorTemp = getCurrentColorTemp(zone);
+      break;
+    case OCCUPANCY_LEFT:
+      Serial.print("[Motion] Timeout - turning light OFF, zone ");
+      Serial.println(zone);
+      zoneState.lightIsOn = false;
+      sendTelemetry(TELEMETRY_MOTION_TIMEOUT, zoneState, false);
+      break;
+    case OCCUPANCY_NONE:
+      // Follows the schedule while someone is moving
+      if (zoneState.occupancy.occupied && zoneState.occupancy.motion)
+        zoneState.currentColorTemp = getCurrentColorTemp(zone);
+      break;
+    }
   }
 }
 
@@ -534,18 +1958,19 @@ void handleBrightnessPot() {
   int potValue = analogRead(PIN_POTENTIOMETER);
   int brightness = map(potValue, 0, ANALOG_MAX_VALUE, 0, 100);
 
+  // Manual mode switches every zone together, zone 0 stands for all of them
   if (brightness <= BRIGHTNESS_OFF_THRESHOLD_PERCENT) {
-    if (state.lightIsOn && !state.modeAuto) {
-      state.lightIsOn = false;
+    if (state.zones[0].lightIsOn && !state.modeAuto) {
+      setAllZonesOn(false);
       Serial.println("[Brightness] Light turned OFF (pot at minimum)");
     }
     state.currentBrightnessPercent = 0;
     return;
   }
 
-  if (!state.modeAuto && !state.lightIsOn &&
+  if (!state.modeAuto && !state.zones[0].lightIsOn &&
       brightness > BRIGHTNESS_OFF_THRESHOLD_PERCENT) {
-    state.lightIsOn = true;
+    setAllZonesOn(true);
     Serial.println("[Brightness] Light turned ON (pot increased)");
   }
 
@@ -555,116 +1980,267 @@ void handleBrightnessPot() {
   }
 }
 
-void updateLighting() {
-  if (!state.lightIsOn) {
-    strip.clear();
-    strip.show();
+void setupRendering() {
+  if (xTaskCreate(renderTask, "render", RENDER_TASK_STACK_SIZE, nullptr,
+                  RENDER_TASK_PRIORITY, &renderTaskHandle) != pdPASS) {
+    Serial.println("[ERROR] Could not start render task");
     return;
   }
+  Serial.println("[INIT] Render task started");
+}
+
+// Renders at TRANSITION_FRAME_MS while a fade runs or dim channels are
+// dithered, otherwise sleeps until updateLighting() or invalidateLighting()
+// wakes it
+void renderTask(void *parameter) {
+  TickType_t lastWake = xTaskGetTickCount();
 
-  uint8_t r, g, b;
-  convertColorTempToRGB(state.currentColorTemp, &r, &g, &b);
+  for (;;) {
+    ZoneFrame frames[ZONE_COUNT];
 
-  int actualBrightness =
-      map(state.currentBrightnessPercent, 0, 100, 0, PWM_MAX_VALUE);
-  strip.setBrightness(actualBrightness);
+    portENTER_CRITICAL(&transitionLock);
+    bool active = sampleTransitions(millis(), frames);
+    portEXIT_CRITICAL(&transitionLock);
 
-  for (int i = 0; i < LED_COUNT; ++i)
-    strip.setPixelColor(i, strip.Color(r, g, b));
+    uint32_t perf = perfStart();
+    renderFrame(frames);
+    perfStop(PERF_RENDER_FRAME, perf);
 
-  strip.show();
+    if (active || rendered.dithering) {
+      vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(TRANSITION_FRAME_MS));
+    } else {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+      lastWake = xTaskGetTickCount();
+    }
+  }
 }
 
-// Tanner Helland's Algorithm for RGB from Kelvin
-// https://tannerhelland.com/2012/09/18/convert-temperature-rgb-algorithm-code.html
-void convertColorTempToRGB(int kelvin, uint8_t *r, uint8_t *g, uint8_t *b) {
-  float temp = kelvin / KELVIN_DIVISOR;
-  float red, green, blue;
+// Current point of every zone's fade, returns whether any is still running
+bool sampleTransitions(unsigned long nowMs, ZoneFrame *frames) {
+  bool active = false;
+  for (int zone = 0; zone < ZONE_COUNT; ++zone)
+    active |= sampleTransition(transitions[zone], nowMs, &frames[zone]);
+  return active;
+}
 
-  // Red calculation
-  if (temp <= 66) {
-    red = 255;
-  } else {
-    red = temp - 60;
-    red = 329.698727446 * pow(red, -0.1332047592);
-    red = constrain(red, 0, 255);
+// Current point of the fade, returns whether it is still running
+bool sampleTransition(const Transition &transition, unsigned long nowMs,
+                      ZoneFrame *frame) {
+  unsigned long elapsed = nowMs - transition.startMs;
+
+  if (elapsed >= transition.durationMs) {
+    frame->brightness = transition.toBrightness;
+    frame->colorTemp = transition.toColorTemp;
+    frame->wipe = 255;
+    return false;
   }
 
-  // Green calculation
-  if (temp <= 66) {
-    green = temp;
-    green = 99.4708025861 * log(green) - 161.1195681661;
-    green = constrain(green, 0, 255);
-  } else {
-    green = temp - 60;
-    green = 288.1221695283 * pow(green, -0.0755148492);
-    green = constrain(green, 0, 255);
+  const ZoneFrame &from = transition.from;
+  int32_t eased = EASING_CURVE[elapsed * (EASING_STEPS - 1) / transition.durationMs];
+  frame->brightness = from.brightness +
+                      (transition.toBrightness - from.brightness) * eased /
+                          EASING_SCALE;
+  frame->colorTemp = from.colorTemp +
+                     (transition.toColorTemp - from.colorTemp) * eased /
+                         EASING_SCALE;
+  frame->wipe = from.wipe + (255 - from.wipe) * eased / EASING_SCALE;
+  return true;
+}
+
+// All zones go out in one frame, the strip is a single DMA transfer however
+// many zones it is split into
+void renderFrame(const ZoneFrame *frames) {
+  bool changed = !rendered.valid || rendered.dithering;
+  for (int zone = 0; zone < ZONE_COUNT; ++zone)
+    changed |= !(rendered.zones[zone] == frames[zone]);
+
+  // Only send actual changes, a frame is not free even with DMA
+  if (!changed)
+    return;
+
+  static PixelColor pixels[LED_COUNT];
+  rendered.valid = true;
+  ++rendered.frame;
+  bool dithering = false;
+  for (int zone = 0; zone < ZONE_COUNT; ++zone) {
+    const ZoneConfig &config = ZONES[zone];
+    const ZoneFrame &frame = frames[zone];
+    rendered.zones[zone] = frame;
+
+    dithering |= renderZonePixels(config.effect, frame.colorTemp, frame.brightness,
+                                  frame.wipe, rendered.frame, pixels,
+                                  config.pixelCount);
+    for (int i = 0; i < config.pixelCount; ++i)
+      ledOutputSetPixel(config.firstPixel + i, pixels[i].r, pixels[i].g,
+                        pixels[i].b);
   }
+  rendered.dithering = dithering;
+  ledOutputShow();
+}
 
-  // Blue calculation
-  if (temp >= 66) {
-    blue = 255;
-  } else if (temp <= 19) {
-    blue = 0;
-  } else {
-    blue = temp - 10;
-    blue = 138.5177312231 * log(blue) - 305.0447927307;
-    blue = constrain(blue, 0, 255);
+// Retargets the fades to the current state, the render task does the rest
+void updateLighting() {
+  unsigned long now = millis();
+  bool changed = false;
+
+  portENTER_CRITICAL(&transitionLock);
+
+  for (int zone = 0; zone < ZONE_COUNT; ++zone) {
+    const ZoneState &zoneState = state.zones[zone];
+    Transition &transition = transitions[zone];
+    int brightness = zoneState.lightIsOn ? map(state.currentBrightnessPercent,
+                                               0, 100, 0, PWM_MAX_VALUE)
+                                         : 0;
+    int colorTemp = zoneState.currentColorTemp;
+
+    // Off keeps the last colour, so fading out does not shift it
+    if (brightness == 0)
+      colorTemp = transition.toColorTemp;
+
+    if (brightness == transition.toBrightness &&
+        colorTemp == transition.toColorTemp)
+      continue;
+    changed = true;
+
+    // Start from wherever the running fade is, retargeting stays smooth
+    ZoneFrame from;
+    sampleTransition(transition, now, &from);
+    // Fading in from off starts at the target colour, not the old one, and
+    // runs the sunrise wipe from the first pixel
+    if (from.brightness == 0) {
+      from.colorTemp = colorTemp;
+      from.wipe = 0;
+    }
+    transition.from = from;
+
+    transition.toBrightness = brightness;
+    transition.toColorTemp = colorTemp;
+    transition.startMs = now;
+    transition.durationMs = TRANSITION_DURATION_MS;
   }
 
-  *r = (uint8_t)red;
-  *g = (uint8_t)green;
-  *b = (uint8_t)blue;
+  portEXIT_CRITICAL(&transitionLock);
+
+  if (changed && renderTaskHandle != nullptr)
+    xTaskNotifyGive(renderTaskHandle);
+}
+
+// Forces the next frame to be sent even if it is unchanged
+void invalidateLighting() {
+  rendered.valid = false;
+  if (renderTaskHandle != nullptr)
+    xTaskNotifyGive(renderTaskHandle);
 }
 
 void setSerialCommands() {
   if (Serial.available() <= 0)
     return;
 
-  String command = Serial.readStringUntil('\n');
-  command.trim();
+  static char line[SERIAL_COMMAND_SIZE];
+  size_t length = Serial.readBytesUntil('\n', line, sizeof(line) - 1);
+  line[length] = '\0';
+
+  char *command = line;
+  while (isspace((unsigned char)*command))
+    ++command;
+  for (char *end = line + length;
+       end > command && isspace((unsigned char)end[-1]); --end)
+    end[-1] = '\0';
 
-  if (command == "status") {
+  if (strcmp(command, "status") == 0) {
+    DeviceState state = readState();
     Serial.println("\nDEVICE STATUS");
     Serial.print("Mode: ");
     Serial.println(state.modeAuto ? "AUTO" : "MANUAL");
-    Serial.print("Light: ");
-    Serial.println(state.lightIsOn ? "ON" : "OFF");
     Serial.print("Brightness: ");
     Serial.print(state.currentBrightnessPercent);
     Serial.println("%");
-    Serial.print("Color Temp: ");
-    Serial.print(state.currentColorTemp);
-    Serial.println("K");
-    Serial.print("Schedule loaded:    ");
-    Serial.println(state.scheduleLoaded ? "Yes" : "No");
-    Serial.print("Night mode enabled: ");
-    Serial.println(schedule.nightModeEnabled ? "Yes" : "No");
-    Serial.print("Night mode status:  ");
-    Serial.println(schedule.nightModeEnabled && isNightTime() ? "Active"
-                                                              : "Inactive");
+    for (int zone = 0; zone < ZONE_COUNT; ++zone) {
+      const ZoneState &zoneState = state.zones[zone];
+      int slot = zoneScheduleSlot(zone);
+      // inputTask replaces schedules[] under pendingScheduleMutex, a copy of
+      // the schedule would not fit this stack
+      xSemaphoreTake(pendingScheduleMutex, portMAX_DELAY);
+      bool nightModeEnabled = schedules[slot].nightModeEnabled;
+      bool night = isNightTime(schedules[slot], state.time.daySeconds);
+      uint32_t nightBoundarySeconds =
+          secondsToNightBoundary(schedules[slot], state.time.daySeconds);
+      xSemaphoreGive(pendingScheduleMutex);
+      Serial.printf("Zone %d (pixels %d-%d, PIR %d, schedule slot %d)\n", zone,
+                    ZONES[zone].firstPixel,
+                    ZONES[zone].firstPixel + ZONES[zone].pixelCount - 1,
+                    ZONES[zone].pirPin, slot);
+      Serial.print("  Light: ");
+      Serial.println(zoneState.lightIsOn ? "ON" : "OFF");
+      Serial.printf("  Occupancy: %s, confidence %d/%d, timeout %lu s\n",
+                    zoneState.occupancy.occupied ? "occupied" : "vacant",
+                    occupancyConfidence(zoneState.occupancy),
+                    OCCUPANCY_WINDOW_SLOTS,
+                    occupancyTimeoutMs(zoneState.occupancy, motionTimeoutMs(zone)) /
+                        1000);
+      Serial.print("  Color Temp: ");
+      Serial.print(zoneState.currentColorTemp);
+      Serial.println("K");
+      Serial.print("  Schedule loaded:    ");
+      Serial.println(state.scheduleLoaded[slot] ? "Yes" : "No");
+      Serial.print("  Night mode enabled: ");
+      Serial.println(nightModeEnabled ? "Yes" : "No");
+      if (nightModeEnabled) {
+        Serial.printf("  Night mode status:  %s, %s in %lu min\n",
+                      night ? "Active" : "Inactive", night ? "ends" : "starts",
+                      (unsigned long)nightBoundarySeconds / 60);
+      } else {
+        Serial.println("  Night mode status:  Inactive");
+      }
+    }
     Serial.print("Telemetry: ");
     Serial.println(TELEMETRY ? "Enabled" : "Disabled");
     Serial.print("Current API Key (first 5): ");
-    Serial.println(currentApiKey.substring(0, 5));
-    time_t now = time(nullptr);
+    Serial.write((const uint8_t *)currentApiKey.c_str(),
+                 std::min(currentApiKey.length(), 5u));
+    Serial.println();
     Serial.print("Current time: ");
-    Serial.print(ctime(&now));
+    Serial.print(ctime(&state.time.now));
     Serial.println();
 
-  } else if (command == "fetch") {
-    fetchSchedule();
-
-  } else if (command == "reset_key") {
+  } else if (strcmp(command, "fetch") == 0) {
+    requestScheduleFetch(0);
+
+  } else if (strcmp(command, "heap") == 0) {
+    heapStatsPrint();
+    Serial.print("JSON arenas peak: schedule ");
+    Serial.print(scheduleJsonArena.peakUsage());
+    Serial.print("/");
+    Serial.print(SCHEDULE_JSON_ARENA_SIZE);
+    Serial.print(", telemetry ");
+    Serial.print(telemetryJsonArena.peakUsage());
+    Serial.print("/");
+    Serial.println(TELEMETRY_JSON_ARENA_SIZE);
+    Serial.print("JSON arena failures: ");
+    Serial.println(scheduleJsonArena.failedAllocations() +
+                   telemetryJsonArena.failedAllocations());
+
+  } else if (strcmp(command, "perf") == 0) {
+    perfStatsPrint();
+
+  } else if (strcmp(command, "perf reset") == 0) {
+    perfStatsReset();
+    Serial.println("Timing histograms reset");
+
+  } else if (strcmp(command, "heap reset") == 0) {
+    heapStatsReset();
+    Serial.println("Heap low-water marks reset");
+
+  } else if (strcmp(command, "reset_key") == 0) {
     preferences.putString("apikey", "");
     Serial.println("API Key cleared from NVS. Rebooting...");
+    flushTelemetry();
     delay(500);
     ESP.restart();
 
-  } else if (command.startsWith("time ")) {
-    String timeStr = command.substring(5);
+  } else if (strncmp(command, "time ", 5) == 0) {
     struct tm tm;
-    if (strptime(timeStr.c_str(), "%Y-%m-%d %H:%M:%S", &tm) == NULL) {
+    if (strptime(command + 5, "%Y-%m-%d %H:%M:%S", &tm) == NULL) {
       Serial.println("[ERROR] Invalid time format. Use: YYYY-MM-DD HH:MM:SS");
       return;
     }
@@ -674,5 +2250,7 @@ void setSerialCommands() {
     settimeofday(&tv, NULL);
     Serial.print("[Time] Set to: ");
     Serial.println(ctime(&t));
+    if (inputTaskHandle != nullptr)
+      xTaskNotifyGive(inputTaskHandle);
   }
 }
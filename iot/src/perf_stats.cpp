@@ -0,0 +1,114 @@
+// Per-stage timing histograms
+//
+// Durations are kept in CPU cycles, in log-linear buckets: four per power of
+// two, so a percentile is off by at most a quarter of its value. Every stage
+// is recorded by a single task, the lock only keeps `perf` from printing a
+// half updated histogram.
+
+#include "perf_stats.h"
+
+const int PERF_SUB_BUCKET_BITS = 2;
+const int PERF_SUB_BUCKETS = 1 << PERF_SUB_BUCKET_BITS;
+const int PERF_BUCKETS = (32 - PERF_SUB_BUCKET_BITS + 1) * PERF_SUB_BUCKETS;
+
+struct PerfHistogram {
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint32_t buckets[PERF_BUCKETS];
+};
+
+static PerfHistogram histograms[PERF_STAGE_COUNT];
+static portMUX_TYPE perfLock = portMUX_INITIALIZER_UNLOCKED;
+
+static const char *const PERF_STAGE_NAMES[PERF_STAGE_COUNT] = {
+    "serial_commands", "time_jump",      "input_edges",    "motion",
+    "brightness_pot",  "update_lighting", "render_frame",  "send_telemetry",
+    "fetch_schedule",  "telemetry_upload",
+};
+
+// Largest value that falls into `bucket`
+static uint32_t bucketUpperBound(int bucket) {
+  if (bucket < PERF_SUB_BUCKETS)
+    return bucket;
+  int octave = bucket / PERF_SUB_BUCKETS + PERF_SUB_BUCKET_BITS - 1;
+  int sub = bucket % PERF_SUB_BUCKETS;
+  uint64_t lower = (uint64_t)(PERF_SUB_BUCKETS + sub) << (octave - PERF_SUB_BUCKET_BITS);
+  uint64_t width = 1ull << (octave - PERF_SUB_BUCKET_BITS);
+  return (uint32_t)std::min<uint64_t>(lower + width - 1, UINT32_MAX);
+}
+
+#if PERF_STATS_ENABLED
+
+static int bucketOf(uint32_t cycles) {
+  if (cycles < (uint32_t)PERF_SUB_BUCKETS)
+    return cycles;
+  int octave = 31 - __builtin_clz(cycles); // >= PERF_SUB_BUCKET_BITS
+  int sub = (cycles >> (octave - PERF_SUB_BUCKET_BITS)) & (PERF_SUB_BUCKETS - 1);
+  return (octave - PERF_SUB_BUCKET_BITS + 1) * PERF_SUB_BUCKETS + sub;
+}
+
+static void record(PerfStage stage, uint32_t cycles) {
+  PerfHistogram &histogram = histograms[stage];
+
+  portENTER_CRITICAL(&perfLock);
+  if (histogram.count == 0 || cycles < histogram.min)
+    histogram.min = cycles;
+  histogram.max = std::max(histogram.max, cycles);
+  ++histogram.count;
+  ++histogram.buckets[bucketOf(cycles)];
+  portEXIT_CRITICAL(&perfLock);
+}
+
+void perfStop(PerfStage stage, uint32_t startCycles) {
+  record(stage, ESP.getCycleCount() - startCycles);
+}
+
+void perfRecordUs(PerfStage stage, uint32_t durationUs) {
+  uint64_t cycles = (uint64_t)durationUs * ESP.getCpuFreqMHz();
+  record(stage, (uint32_t)std::min<uint64_t>(cycles, UINT32_MAX));
+}
+
+#endif
+
+// Upper bound of the bucket holding the `permille` quantile
+static uint32_t percentile(const PerfHistogram &histogram, uint32_t permille) {
+  uint32_t rank = ((uint64_t)histogram.count * permille + 999) / 1000;
+  uint32_t seen = 0;
+  for (int bucket = 0; bucket < PERF_BUCKETS; ++bucket) {
+    seen += histogram.buckets[bucket];
+    if (seen >= rank)
+      return constrain(bucketUpperBound(bucket), histogram.min, histogram.max);
+  }
+  return histogram.max;
+}
+
+void perfStatsPrint() {
+  float cyclesPerUs = ESP.getCpuFreqMHz();
+
+  Serial.println("\nPERF (us)              count       min       p50       p99       max");
+  for (int stage = 0; stage < PERF_STAGE_COUNT; ++stage) {
+    portENTER_CRITICAL(&perfLock);
+    PerfHistogram histogram = histograms[stage];
+    portEXIT_CRITICAL(&perfLock);
+
+    Serial.printf("%-18s %9lu", PERF_STAGE_NAMES[stage],
+                  (unsigned long)histogram.count);
+    if (histogram.count == 0) {
+      Serial.println();
+      continue;
+    }
+    Serial.printf(" %9.1f %9.1f %9.1f %9.1f\n", histogram.min / cyclesPerUs,
+                  percentile(histogram, 500) / cyclesPerUs,
+                  percentile(histogram, 990) / cyclesPerUs,
+                  histogram.max / cyclesPerUs);
+  }
+}
+
+void perfStatsReset() {
+  for (PerfHistogram &histogram : histograms) {
+    portENTER_CRITICAL(&perfLock);
+    memset(&histogram, 0, sizeof(histogram));
+    portEXIT_CRITICAL(&perfLock);
+  }
+}
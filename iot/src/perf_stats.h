@@ -0,0 +1,42 @@
+// Per-stage timing histograms
+#ifndef LUMIRUM_PERF_STATS_H
+#define LUMIRUM_PERF_STATS_H
+#include "config.h"
+
+enum PerfStage : uint8_t {
+  PERF_SERIAL_COMMANDS,
+  PERF_TIME_JUMP,
+  PERF_INPUT_EDGES, // Button and PIR edges
+  PERF_MOTION,
+  PERF_BRIGHTNESS_POT,
+  PERF_UPDATE_LIGHTING,
+  PERF_RENDER_FRAME,
+  PERF_SEND_TELEMETRY,    // Enqueueing only
+  PERF_FETCH_SCHEDULE,    // Whole request, timed with micros()
+  PERF_TELEMETRY_UPLOAD,  // One batch, timed with micros()
+  PERF_STAGE_COUNT,
+};
+
+#if PERF_STATS_ENABLED
+
+// Cycle counter timing for stages that cannot span a light sleep. Includes
+// time spent in higher priority tasks and interrupts.
+inline uint32_t perfStart() { return ESP.getCycleCount(); }
+void perfStop(PerfStage stage, uint32_t startCycles);
+
+// For stages that block on the network and may outlast the cycle counter
+void perfRecordUs(PerfStage stage, uint32_t durationUs);
+
+#else
+
+inline uint32_t perfStart() { return 0; }
+inline void perfStop(PerfStage, uint32_t) {}
+inline void perfRecordUs(PerfStage, uint32_t) {}
+
+#endif
+
+// Prints count, min, p50, p99 and max of every stage
+void perfStatsPrint();
+void perfStatsReset();
+
+#endif // LUMIRUM_PERF_STATS_H
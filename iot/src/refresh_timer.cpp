@@ -0,0 +1,54 @@
+#include "refresh_timer.h"
+
+uint32_t refreshSeed(const char *key) {
+  uint32_t hash = 2166136261u;
+  for (; *key != '\0'; ++key)
+    hash = (hash ^ (uint8_t)*key) * 16777619u;
+  return hash;
+}
+
+void refreshBegin(RefreshTimer &timer, uint32_t seed, unsigned long nowMs) {
+  timer.dueMs = nowMs;
+  timer.backoffMs = 0;
+  timer.jitter = seed != 0 ? seed : 1;
+}
+
+unsigned long refreshJitterMs(RefreshTimer &timer, unsigned long windowMs) {
+  uint32_t x = timer.jitter;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  timer.jitter = x;
+  return windowMs > 0 ? x % windowMs : 0;
+}
+
+void refreshAfter(RefreshTimer &timer, unsigned long nowMs, unsigned long delayMs,
+                  unsigned long windowMs) {
+  timer.backoffMs = 0;
+  timer.dueMs = nowMs + delayMs + refreshJitterMs(timer, windowMs);
+}
+
+void refreshWithin(RefreshTimer &timer, unsigned long nowMs, unsigned long windowMs) {
+  // Overdue wraps around to a large distance
+  if (timer.dueMs - nowMs >= windowMs)
+    timer.dueMs = nowMs + refreshJitterMs(timer, windowMs);
+}
+
+void refreshFailed(RefreshTimer &timer, unsigned long nowMs, unsigned long minMs,
+                   unsigned long maxMs) {
+  timer.backoffMs =
+      timer.backoffMs == 0 ? minMs : std::min(timer.backoffMs * 2, maxMs);
+  timer.dueMs =
+      nowMs + timer.backoffMs - refreshJitterMs(timer, timer.backoffMs / 2);
+}
+
+unsigned long scheduleRefreshDelayMs(time_t validUntil, time_t now) {
+  if (validUntil == 0 || now < MIN_VALID_EPOCH_SEC)
+    return SCHEDULE_REFRESH_INTERVAL_MS;
+
+  long long untilMs =
+      ((long long)validUntil - SCHEDULE_REFRESH_LEAD_SEC - now) * 1000;
+  // Also when the server kept an old one, a 304 does not move validUntil
+  return (unsigned long)constrain(untilMs, (long long)SCHEDULE_REFRESH_MIN_MS,
+                                  (long long)SCHEDULE_REFRESH_MAX_MS);
+}
@@ -0,0 +1,50 @@
+// Jittered refresh and retry timing of periodic requests
+//
+// Every device of a fleet boots, reconnects and syncs its clock at the same
+// moments after a site-wide power restore. The timers put each request at a
+// pseudo-random point of a window, seeded from the device key so devices
+// spread apart and stay apart. Only depends on hal.h, like the lighting core.
+#ifndef LUMIRUM_REFRESH_TIMER_H
+#define LUMIRUM_REFRESH_TIMER_H
+#include "config.h"
+
+struct RefreshTimer {
+  unsigned long dueMs = 0;
+  unsigned long backoffMs = 0; // 0 = the last attempt succeeded
+  uint32_t jitter = 1;         // xorshift32 state, never 0
+};
+
+// Seed of a device's timers, FNV-1a of its API key
+uint32_t refreshSeed(const char *key);
+void refreshBegin(RefreshTimer &timer, uint32_t seed, unsigned long nowMs);
+
+// Pseudo-random offset in [0, windowMs)
+unsigned long refreshJitterMs(RefreshTimer &timer, unsigned long windowMs);
+
+// After a successful attempt: due in `delayMs` plus up to `windowMs`
+void refreshAfter(RefreshTimer &timer, unsigned long nowMs, unsigned long delayMs,
+                  unsigned long windowMs);
+
+// Brings the next attempt forward to within `windowMs`, an overdue one is
+// moved there as well so a backlog does not go out all at once
+void refreshWithin(RefreshTimer &timer, unsigned long nowMs, unsigned long windowMs);
+
+// After a failed attempt: the backoff doubles from `minMs` up to `maxMs` and
+// the retry is due somewhere in its upper half
+void refreshFailed(RefreshTimer &timer, unsigned long nowMs, unsigned long minMs,
+                   unsigned long maxMs);
+
+inline bool refreshDue(const RefreshTimer &timer, unsigned long nowMs) {
+  return (long)(nowMs - timer.dueMs) >= 0;
+}
+
+inline unsigned long refreshRemainingMs(const RefreshTimer &timer,
+                                        unsigned long nowMs) {
+  return refreshDue(timer, nowMs) ? 0 : timer.dueMs - nowMs;
+}
+
+// Time until schedules expiring at `validUntil` should be fetched again,
+// SCHEDULE_REFRESH_INTERVAL_MS without a schedule or a synced clock
+unsigned long scheduleRefreshDelayMs(time_t validUntil, time_t now);
+
+#endif // LUMIRUM_REFRESH_TIMER_H
@@ -0,0 +1,62 @@
+#include "telemetry_encoding.h"
+
+const uint8_t EVENT_MOTION_DETECTED = 0x10;
+const uint8_t EVENT_LIGHT_IS_ON = 0x20;
+const uint8_t EVENT_HAS_COLOR_TEMP = 0x40;
+const uint8_t EVENT_HAS_TIMESTAMP = 0x80;
+
+static_assert(TELEMETRY_BATCH_SIZE <= 255, "the event count is one byte");
+
+// LEB128 of the zigzag encoding, small differences of either sign take a byte
+static uint8_t *putVarint(uint8_t *out, int64_t value) {
+  uint64_t zigzag = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+  while (zigzag >= 0x80) {
+    *out++ = (uint8_t)zigzag | 0x80;
+    zigzag >>= 7;
+  }
+  *out++ = (uint8_t)zigzag;
+  return out;
+}
+
+size_t encodeTelemetryBatch(const SpooledEvent *events, int count, int eventTypes,
+                            uint8_t *out, size_t size) {
+  if (count > 255 ||
+      size < TELEMETRY_BINARY_HEADER_SIZE + (size_t)count * TELEMETRY_BINARY_EVENT_SIZE)
+    return 0;
+
+  uint8_t *cursor = out + TELEMETRY_BINARY_HEADER_SIZE;
+  int encoded = 0;
+  int64_t previousColorTemp = 0;
+  int64_t previousTime = 0;
+
+  for (int i = 0; i < count; ++i) {
+    const SpooledEvent &event = events[i];
+    if (event.type >= eventTypes || event.type >= TELEMETRY_BINARY_MAX_EVENT_TYPES)
+      continue; // Corrupted in NVS
+
+    bool hasColorTemp = event.colorTemp >= API_MIN_TEMP_CONSTRAINT_K;
+    // Still relative to boot if the clock never synced, the server uses its own
+    bool hasTime = event.time != 0 && !(event.flags & SPOOLED_TIME_UPTIME);
+
+    *cursor++ = event.type |
+                (event.flags & SPOOLED_MOTION_DETECTED ? EVENT_MOTION_DETECTED : 0) |
+                (event.flags & SPOOLED_LIGHT_IS_ON ? EVENT_LIGHT_IS_ON : 0) |
+                (hasColorTemp ? EVENT_HAS_COLOR_TEMP : 0) |
+                (hasTime ? EVENT_HAS_TIMESTAMP : 0);
+    *cursor++ = event.brightnessPercent;
+
+    if (hasColorTemp) {
+      cursor = putVarint(cursor, event.colorTemp - previousColorTemp);
+      previousColorTemp = event.colorTemp;
+    }
+    if (hasTime) {
+      cursor = putVarint(cursor, (int64_t)event.time - previousTime);
+      previousTime = event.time;
+    }
+    ++encoded;
+  }
+
+  out[0] = TELEMETRY_BINARY_VERSION;
+  out[1] = (uint8_t)encoded;
+  return cursor - out;
+}
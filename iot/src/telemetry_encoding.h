@@ -0,0 +1,25 @@
+// Compact binary telemetry batches
+//
+// The layout is documented on CreateTelemetryBatch::from_bytes in the server.
+// Timestamps and colour temperatures are sent as zigzag varint differences
+// to the previous event, a typical event takes 4 to 6 bytes instead of the
+// ~125 of its JSON object.
+#ifndef LUMIRUM_TELEMETRY_ENCODING_H
+#define LUMIRUM_TELEMETRY_ENCODING_H
+#include "telemetry_spool.h"
+
+#define TELEMETRY_BINARY_CONTENT_TYPE "application/octet-stream"
+const uint8_t TELEMETRY_BINARY_VERSION = 1;
+const int TELEMETRY_BINARY_MAX_EVENT_TYPES = 16; // Codes share a byte with flags
+const size_t TELEMETRY_BINARY_HEADER_SIZE = 2;   // version, event count
+const size_t TELEMETRY_BINARY_EVENT_SIZE = 10; // Worst case, header, brightness
+                                               // and two varints
+const size_t TELEMETRY_BINARY_PAYLOAD_SIZE =
+    TELEMETRY_BINARY_HEADER_SIZE + TELEMETRY_BATCH_SIZE * TELEMETRY_BINARY_EVENT_SIZE;
+
+// Encodes `events` into `out`, skipping types of `eventTypes` or above.
+// Returns the length, 0 if `size` could be too small for `count` events.
+size_t encodeTelemetryBatch(const SpooledEvent *events, int count, int eventTypes,
+                            uint8_t *out, size_t size);
+
+#endif // LUMIRUM_TELEMETRY_ENCODING_H
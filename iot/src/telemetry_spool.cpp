@@ -0,0 +1,164 @@
+// Offline telemetry spool
+//
+// Events are kept in a RAM ring owned by the telemetry task. When it fills
+// up, its oldest TELEMETRY_BATCH_SIZE events are written to NVS as one blob,
+// NVS batches form a ring of TELEMETRY_SPOOL_NVS_CHUNKS keys whose sequence
+// numbers are stored too, so they survive a reboot. Everything is oldest
+// first, NVS batches are always older than what is in RAM. A batch carries the
+// boot it was written in, times since boot are only resolved within that boot.
+
+#include "telemetry_spool.h"
+#include <Preferences.h>
+
+static SpooledEvent ring[TELEMETRY_SPOOL_LENGTH];
+static int ringStart = 0;
+static int ringCount = 0;
+
+static Preferences nvs;
+static bool nvsReady = false;
+static uint32_t chunkHead = 0; // Sequence number of the next batch written
+static uint32_t chunkTail = 0; // Sequence number of the oldest batch
+static uint32_t bootCount = 0; // Counted in NVS, tags the batches of this boot
+
+// An NVS batch, the events may be fewer than TELEMETRY_BATCH_SIZE
+struct __attribute__((packed)) SpooledChunk {
+  uint32_t boot;
+  SpooledEvent events[TELEMETRY_BATCH_SIZE];
+};
+
+static void chunkKey(uint32_t sequence, char *key, size_t size) {
+  snprintf(key, size, "c%u", (unsigned)(sequence % TELEMETRY_SPOOL_NVS_CHUNKS));
+}
+
+// Turns a time since boot into unix time once the clock is synced. `final`
+// gives up on it instead, for times since an earlier boot.
+static void resolveTime(SpooledEvent &event, bool final) {
+  if (!(event.flags & SPOOLED_TIME_UPTIME))
+    return;
+
+  time_t now = time(nullptr);
+  if (now >= MIN_VALID_EPOCH_SEC) {
+    event.time = now - (millis() / 1000 - event.time);
+    event.flags &= ~SPOOLED_TIME_UPTIME;
+  } else if (final) {
+    event.time = 0;
+    event.flags &= ~SPOOLED_TIME_UPTIME;
+  }
+}
+
+static void dropOldestChunk() {
+  char key[8];
+  chunkKey(chunkTail, key, sizeof(key));
+  nvs.remove(key);
+  ++chunkTail;
+  nvs.putUInt("tail", chunkTail);
+}
+
+// Moves up to a batch of the oldest RAM events into a new NVS batch
+static bool spillOldest() {
+  if (!nvsReady)
+    return false;
+
+  SpooledChunk chunk;
+  chunk.boot = bootCount;
+  int count = min(ringCount, TELEMETRY_BATCH_SIZE);
+  for (int i = 0; i < count; ++i) {
+    chunk.events[i] = ring[(ringStart + i) % TELEMETRY_SPOOL_LENGTH];
+    resolveTime(chunk.events[i], false);
+  }
+
+  if (chunkHead - chunkTail >= (uint32_t)TELEMETRY_SPOOL_NVS_CHUNKS) {
+    Serial.println("[Telemetry] Spool full, dropping oldest batch");
+    dropOldestChunk();
+  }
+
+  char key[8];
+  chunkKey(chunkHead, key, sizeof(key));
+  size_t size = sizeof(chunk.boot) + count * sizeof(SpooledEvent);
+  if (nvs.putBytes(key, &chunk, size) != size)
+    return false;
+  ++chunkHead;
+  nvs.putUInt("head", chunkHead);
+
+  ringStart = (ringStart + count) % TELEMETRY_SPOOL_LENGTH;
+  ringCount -= count;
+  return true;
+}
+
+void telemetrySpoolBegin() {
+  if (TELEMETRY_SPOOL_NVS_CHUNKS == 0 || !nvs.begin("telemetry", false))
+    return;
+
+  nvsReady = true;
+  chunkHead = nvs.getUInt("head", 0);
+  chunkTail = nvs.getUInt("tail", 0);
+  if (chunkHead - chunkTail > (uint32_t)TELEMETRY_SPOOL_NVS_CHUNKS)
+    chunkTail = chunkHead; // Inconsistent after a power cut, start over
+  bootCount = nvs.getUInt("boot", 0) + 1;
+  nvs.putUInt("boot", bootCount);
+
+  if (chunkHead != chunkTail) {
+    Serial.print("[INIT] Telemetry batches spooled before reboot: ");
+    Serial.println((unsigned long)(chunkHead - chunkTail));
+  }
+}
+
+void telemetrySpoolPush(const SpooledEvent &event) {
+  if (ringCount == TELEMETRY_SPOOL_LENGTH && !spillOldest()) {
+    Serial.println("[Telemetry] Spool full, dropping oldest event");
+    ringStart = (ringStart + 1) % TELEMETRY_SPOOL_LENGTH;
+    --ringCount;
+  }
+
+  ring[(ringStart + ringCount) % TELEMETRY_SPOOL_LENGTH] = event;
+  ++ringCount;
+}
+
+int telemetrySpoolPeek(SpooledEvent *events, int max) {
+  while (chunkHead != chunkTail) {
+    char key[8];
+    chunkKey(chunkTail, key, sizeof(key));
+    SpooledChunk chunk;
+    size_t size = nvs.getBytes(key, &chunk, sizeof(chunk));
+    int count = size > sizeof(chunk.boot)
+                    ? (size - sizeof(chunk.boot)) / sizeof(SpooledEvent)
+                    : 0;
+    if (count > 0 &&
+        size == sizeof(chunk.boot) + count * sizeof(SpooledEvent)) {
+      count = min(count, max);
+      for (int i = 0; i < count; ++i) {
+        events[i] = chunk.events[i];
+        resolveTime(events[i], chunk.boot != bootCount);
+      }
+      return count;
+    }
+    dropOldestChunk(); // Unreadable, or of a firmware without the boot tag
+  }
+
+  int count = min(max, ringCount);
+  for (int i = 0; i < count; ++i) {
+    events[i] = ring[(ringStart + i) % TELEMETRY_SPOOL_LENGTH];
+    resolveTime(events[i], false);
+  }
+  return count;
+}
+
+void telemetrySpoolPop(int count) {
+  if (chunkHead != chunkTail) {
+    dropOldestChunk(); // Peek returned the whole batch
+    return;
+  }
+
+  count = min(count, ringCount);
+  ringStart = (ringStart + count) % TELEMETRY_SPOOL_LENGTH;
+  ringCount -= count;
+}
+
+int telemetrySpoolBuffered() { return ringCount; }
+
+bool telemetrySpoolHasBacklog() { return chunkHead != chunkTail; }
+
+void telemetrySpoolPersist() {
+  while (ringCount > 0 && spillOldest()) {
+  }
+}
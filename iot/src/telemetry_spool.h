@@ -0,0 +1,39 @@
+// Offline telemetry spool
+#ifndef LUMIRUM_TELEMETRY_SPOOL_H
+#define LUMIRUM_TELEMETRY_SPOOL_H
+#include "config.h"
+
+const uint8_t SPOOLED_MOTION_DETECTED = 0x01;
+const uint8_t SPOOLED_LIGHT_IS_ON = 0x02;
+const uint8_t SPOOLED_TIME_UPTIME = 0x04; // `time` is seconds since boot
+
+struct __attribute__((packed)) SpooledEvent {
+  uint32_t time; // Unix seconds, 0 if unknown
+  uint16_t colorTemp;
+  uint8_t type; // Meaning is up to the caller
+  uint8_t brightnessPercent;
+  uint8_t flags; // SPOOLED_*
+};
+
+// Opens the NVS overflow and picks up batches left by a previous boot
+void telemetrySpoolBegin();
+
+// Appends an event, a full RAM ring spills its oldest batch to NVS. When NVS
+// is full as well the oldest batch there is dropped.
+void telemetrySpoolPush(const SpooledEvent &event);
+
+// Copies out the oldest events, NVS batches before RAM. `max` must be at
+// least TELEMETRY_BATCH_SIZE. Times since boot are resolved once the clock
+// is synced.
+int telemetrySpoolPeek(SpooledEvent *events, int max);
+
+// Drops what the last telemetrySpoolPeek() returned
+void telemetrySpoolPop(int count);
+
+int telemetrySpoolBuffered(); // Events in RAM
+bool telemetrySpoolHasBacklog(); // Batches in NVS
+
+// Moves everything still in RAM to NVS, e.g. before a reboot
+void telemetrySpoolPersist();
+
+#endif // LUMIRUM_TELEMETRY_SPOOL_H
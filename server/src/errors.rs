@@ -60,6 +60,8 @@ pub enum Error {
     InvalidData(#[from] garde::Report),
     #[error(transparent)]
     InvalidJson(#[from] axum::extract::rejection::JsonRejection),
+    #[error("invalid binary telemetry: {0}")]
+    InvalidTelemetry(String),
 
     // Internal
     #[error("database: {0}")]
@@ -97,7 +99,7 @@ impl From<&Error> for StatusCode {
             | Error::DeviceNotFound
             | Error::TelemetryNotFound => Self::NOT_FOUND,
 
-            Error::InvalidJson(_) => Self::BAD_REQUEST,
+            Error::InvalidJson(_) | Error::InvalidTelemetry(_) => Self::BAD_REQUEST,
             Error::InvalidData(_) => Self::UNPROCESSABLE_ENTITY,
 
             Error::Database(_)
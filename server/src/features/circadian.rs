@@ -1,6 +1,7 @@
 use chrono::{
     DateTime,
     Duration,
+    DurationRound,
     NaiveDate,
     NaiveTime,
     Offset,
@@ -8,6 +9,30 @@ use chrono::{
     Timelike,
     Utc,
 };
+use std::{
+    collections::HashMap,
+    hash::{
+        DefaultHasher,
+        Hash,
+        Hasher,
+    },
+    sync::{
+        Arc,
+        Mutex,
+        PoisonError,
+    },
+};
+
+use axum::{
+    body::Bytes,
+    http::{
+        HeaderMap,
+        header::{
+            ACCEPT,
+            IF_NONE_MATCH,
+        },
+    },
+};
 use chrono_tz::Tz;
 use serde::{
     Deserialize,
@@ -18,6 +43,10 @@ use sunrise::{
     SolarDay,
     SolarEvent,
 };
+use tokio::sync::{
+    OnceCell,
+    broadcast,
+};
 use utoipa::ToSchema;
 
 use crate::{
@@ -47,6 +76,7 @@ pub struct LightingSchedule {
     pub valid_until: DateTime<Utc>,
 
     /// Lookup table of lighting data points
+    // NOTE: must stay the last field, devices stream-parse everything before it
     pub schedule: Vec<LightingPoint>,
 }
 
@@ -60,9 +90,253 @@ pub struct LightingPoint {
     pub color_temp: i32,
 }
 
-/// Convert local time to seconds since midnight UTC
-fn to_utc_seconds_from_midnight(local_time: NaiveTime, timezone: Tz) -> u32 {
-    let now_in_tz = Utc::now().with_timezone(&timezone);
+/// Media type of the compact schedule representation, see [`LightingSchedule::to_bytes`]
+pub const BINARY_SCHEDULE_MEDIA_TYPE: &str = "application/octet-stream";
+
+/// Media type of the cached JSON bodies
+pub const JSON_MEDIA_TYPE: &str = "application/json";
+
+/// Whether the client asked for the compact schedule representation
+pub fn accepts_binary(headers: &HeaderMap) -> bool {
+    headers
+        .get_all(ACCEPT)
+        .iter()
+        .filter_map(|value| value.to_str().ok())
+        .any(|value| value.contains(BINARY_SCHEDULE_MEDIA_TYPE))
+}
+
+/// How long a device may keep using a schedule it already has, it covers a day ahead
+pub const SCHEDULE_REUSE_SECONDS: i64 = 12 * 3600;
+
+/// Points in a generated schedule
+pub const SCHEDULE_POINTS: u16 = 96;
+/// Time between two points of a generated schedule, schedules start on a multiple of it
+pub const SCHEDULE_STEP_MINUTES: i64 = 15;
+
+/// A generated schedule together with the response bodies sent for it
+pub struct CachedSchedule {
+    pub schedule: LightingSchedule,
+    pub etag: String,
+    /// JSON body, `Some(schedule)` serializes the same as `schedule`
+    pub json: Bytes,
+    /// Binary body, see [`LightingSchedule::to_bytes`]
+    pub binary: Bytes,
+}
+
+impl CachedSchedule {
+    fn generate(profile: &Profile, start: DateTime<Utc>) -> Result<Self, Error> {
+        let schedule = profile.calculate(
+            start,
+            SCHEDULE_POINTS,
+            Duration::minutes(SCHEDULE_STEP_MINUTES),
+        )?;
+        let json = serde_json::to_vec(&schedule)
+            .map_err(|error| Error::DataCorruption(format!("schedule json: {error}")))?;
+
+        Ok(Self {
+            etag: schedule.etag(profile),
+            json: json.into(),
+            binary: schedule.to_bytes()?.into(),
+            schedule,
+        })
+    }
+}
+
+/// Generated schedules by profile id, every device of a profile gets the same one until the
+/// next [`SCHEDULE_STEP_MINUTES`] slot starts or the profile changes. Cloning is cheap.
+#[derive(Clone, Default)]
+pub struct ScheduleCache(Arc<Mutex<HashMap<i64, CacheSlot>>>);
+
+/// The schedule of one profile for one slot, generated once by the first request for it
+struct CacheSlot {
+    /// [`Profile::schedule_fingerprint`] of the profile it is generated from
+    fingerprint: u64,
+    start: DateTime<Utc>,
+    schedule: Arc<OnceCell<Arc<CachedSchedule>>>,
+}
+
+impl ScheduleCache {
+    /// The schedule of `profile` for the current slot, generated on the first request for it
+    pub async fn get(&self, profile: &Profile) -> Result<Arc<CachedSchedule>, Error> {
+        let now = Utc::now();
+        let start = now
+            .duration_trunc(Duration::minutes(SCHEDULE_STEP_MINUTES))
+            .unwrap_or(now);
+        let fingerprint = profile.schedule_fingerprint();
+
+        // The map is only locked to find the slot, other profiles never wait on a generation
+        let schedule = {
+            let mut entries = self.0.lock().unwrap_or_else(PoisonError::into_inner);
+            match entries
+                .get(&profile.id)
+                .filter(|slot| slot.fingerprint == fingerprint && slot.start == start)
+            {
+                Some(slot) => Arc::clone(&slot.schedule),
+                None => {
+                    let schedule = Arc::default();
+                    entries.insert(
+                        profile.id,
+                        CacheSlot {
+                            fingerprint,
+                            start,
+                            schedule: Arc::clone(&schedule),
+                        },
+                    );
+                    schedule
+                }
+            }
+        };
+
+        // A fleet asking at once waits for the first request's generation, a failed one is
+        // retried by the next
+        schedule
+            .get_or_try_init(|| async { CachedSchedule::generate(profile, start).map(Arc::new) })
+            .await
+            .cloned()
+    }
+
+    /// Drop the schedule of an updated or deleted profile
+    pub fn invalidate(&self, profile_id: i64) {
+        self.0
+            .lock()
+            .unwrap_or_else(PoisonError::into_inner)
+            .remove(&profile_id);
+    }
+}
+
+/// Something that may change the schedule a device should be using
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum ScheduleChange {
+    /// The profile was updated or deleted
+    Profile(i64),
+    /// The device was updated, e.g. assigned another profile
+    Device(i64),
+}
+
+impl ScheduleChange {
+    pub fn affects(self, device_id: i64, profile_id: Option<i64>) -> bool {
+        match self {
+            Self::Profile(id) => profile_id == Some(id),
+            Self::Device(id) => id == device_id,
+        }
+    }
+}
+
+/// Fan-out of [`ScheduleChange`]s to the devices waiting for one, cloning is cheap
+#[derive(Clone)]
+pub struct ScheduleChanges(broadcast::Sender<ScheduleChange>);
+
+impl ScheduleChanges {
+    /// Changes a slow waiter may fall behind by before it has to recheck everything
+    const CAPACITY: usize = 256;
+
+    pub fn notify(&self, change: ScheduleChange) {
+        // Nobody waiting is fine
+        let _ = self.0.send(change);
+    }
+
+    pub fn subscribe(&self) -> broadcast::Receiver<ScheduleChange> {
+        self.0.subscribe()
+    }
+}
+
+impl Default for ScheduleChanges {
+    fn default() -> Self {
+        Self(broadcast::channel(Self::CAPACITY).0)
+    }
+}
+
+impl LightingSchedule {
+    /// `ETag` of this schedule, see [`Profile::schedule_etag`]
+    pub fn etag(&self, profile: &Profile) -> String {
+        profile.schedule_etag(self.generated_at)
+    }
+
+    /// Version byte of the layout produced by [`Self::to_bytes`]
+    pub const BINARY_VERSION: u8 = 1;
+    /// Size of the fixed header in bytes
+    pub const BINARY_HEADER_SIZE: usize = 36;
+
+    /// Encode into the compact little-endian layout used by devices.
+    ///
+    /// | bytes | field |
+    /// |-------|-------|
+    /// | 1 | version, [`Self::BINARY_VERSION`] |
+    /// | 1 | flags, bit 0 is `night_mode_enabled` |
+    /// | 2 | number of points |
+    /// | 8 | `profile_id` |
+    /// | 4 | `sleep_start_utc_seconds` |
+    /// | 4 | `sleep_end_utc_seconds` |
+    /// | 2 | `min_color_temp` |
+    /// | 2 | `max_color_temp` |
+    /// | 4 | `motion_timeout_seconds` |
+    /// | 4 | `generated_at`, unix seconds |
+    /// | 4 | `valid_until`, unix seconds |
+    ///
+    /// Followed by a `u16` seconds since the previous point (the first one since `generated_at`)
+    /// and a `u16` color temperature for every point.
+    pub fn to_bytes(&self) -> Result<Vec<u8>, Error> {
+        let out_of_range = |field: &str| {
+            Error::DataCorruption(format!("{field} does not fit the binary schedule"))
+        };
+
+        let generated_at = self.generated_at.timestamp();
+
+        let mut bytes = Vec::with_capacity(Self::BINARY_HEADER_SIZE + self.schedule.len() * 4);
+        bytes.push(Self::BINARY_VERSION);
+        bytes.push(u8::from(self.night_mode_enabled));
+        bytes.extend_from_slice(
+            &u16::try_from(self.schedule.len())
+                .map_err(|_| out_of_range("schedule"))?
+                .to_le_bytes(),
+        );
+        bytes.extend_from_slice(&self.profile_id.to_le_bytes());
+        bytes.extend_from_slice(&self.sleep_start_utc_seconds.to_le_bytes());
+        bytes.extend_from_slice(&self.sleep_end_utc_seconds.to_le_bytes());
+        for (field, value) in [
+            ("min_color_temp", self.min_color_temp),
+            ("max_color_temp", self.max_color_temp),
+        ] {
+            bytes.extend_from_slice(
+                &u16::try_from(value)
+                    .map_err(|_| out_of_range(field))?
+                    .to_le_bytes(),
+            );
+        }
+        bytes.extend_from_slice(
+            &u32::try_from(self.motion_timeout_seconds)
+                .map_err(|_| out_of_range("motion_timeout_seconds"))?
+                .to_le_bytes(),
+        );
+        for (field, value) in [
+            ("generated_at", generated_at),
+            ("valid_until", self.valid_until.timestamp()),
+        ] {
+            bytes.extend_from_slice(
+                &u32::try_from(value)
+                    .map_err(|_| out_of_range(field))?
+                    .to_le_bytes(),
+            );
+        }
+
+        let mut previous = generated_at;
+        for point in &self.schedule {
+            let timestamp = point.timestamp.timestamp();
+            let delta = u16::try_from(timestamp - previous).map_err(|_| out_of_range("utc"))?;
+            let color_temp = u16::try_from(point.color_temp).map_err(|_| out_of_range("temp"))?;
+
+            bytes.extend_from_slice(&delta.to_le_bytes());
+            bytes.extend_from_slice(&color_temp.to_le_bytes());
+            previous = timestamp;
+        }
+
+        Ok(bytes)
+    }
+}
+
+/// Convert local time on the day of `at` to seconds since midnight UTC
+fn to_utc_seconds_from_midnight(local_time: NaiveTime, timezone: Tz, at: DateTime<Utc>) -> u32 {
+    let now_in_tz = at.with_timezone(&timezone);
     let today_naive = now_in_tz.date_naive();
 
     let local_naive_dt = today_naive.and_time(local_time);
@@ -80,9 +354,87 @@ fn to_utc_seconds_from_midnight(local_time: NaiveTime, timezone: Tz) -> u32 {
 }
 
 impl Profile {
-    /// Compute a lighting schedule for a profile
-    pub fn calculate(&self, points: u16, offset: Duration) -> Result<LightingSchedule, Error> {
-        let now = Utc::now();
+    /// Hash of every field [`Self::calculate`] depends on, so any edit changes it.
+    /// Only stable within one build, a server upgrade costs devices one full fetch.
+    fn schedule_fingerprint(&self) -> u64 {
+        let mut hasher = DefaultHasher::new();
+        self.latitude.map(f64::to_bits).hash(&mut hasher);
+        self.longitude.map(f64::to_bits).hash(&mut hasher);
+        self.timezone.hash(&mut hasher);
+        self.sleep_start.hash(&mut hasher);
+        self.sleep_end.hash(&mut hasher);
+        self.night_mode_enabled.hash(&mut hasher);
+        self.min_color_temp.hash(&mut hasher);
+        self.max_color_temp.hash(&mut hasher);
+        self.motion_timeout_seconds.hash(&mut hasher);
+        hasher.finish()
+    }
+
+    /// `ETag` of a schedule generated at `generated_at`: `"<profile_id>-<unix seconds>-<fingerprint>"`
+    pub fn schedule_etag(&self, generated_at: DateTime<Utc>) -> String {
+        format!(
+            "\"{}-{}-{:016x}\"",
+            self.id,
+            generated_at.timestamp(),
+            self.schedule_fingerprint()
+        )
+    }
+
+    /// The tag from `If-None-Match` that names a schedule of this profile that is unchanged and
+    /// was generated less than [`SCHEDULE_REUSE_SECONDS`] ago
+    pub fn current_schedule_etag<'a>(&self, headers: &'a HeaderMap) -> Option<&'a str> {
+        let now = Utc::now().timestamp();
+        self.schedule_etag(headers, |generated_at| {
+            (0..SCHEDULE_REUSE_SECONDS).contains(&(now - generated_at))
+        })
+    }
+
+    /// The tag from `If-None-Match` that names a schedule of this profile that is unchanged,
+    /// however old it is
+    pub fn unchanged_schedule_etag<'a>(&self, headers: &'a HeaderMap) -> Option<&'a str> {
+        self.schedule_etag(headers, |_| true)
+    }
+
+    fn schedule_etag<'a>(
+        &self,
+        headers: &'a HeaderMap,
+        fresh: impl Fn(i64) -> bool,
+    ) -> Option<&'a str> {
+        let fingerprint = self.schedule_fingerprint();
+
+        headers
+            .get_all(IF_NONE_MATCH)
+            .iter()
+            .filter_map(|value| value.to_str().ok())
+            .flat_map(|value| value.split(','))
+            .map(str::trim)
+            .find(|&tag| {
+                let matches = || -> Option<bool> {
+                    let opaque = tag.strip_prefix("W/").unwrap_or(tag);
+                    let mut parts = opaque.strip_prefix('"')?.strip_suffix('"')?.split('-');
+
+                    let profile_id = parts.next()?.parse::<i64>().ok()?;
+                    let generated_at = parts.next()?.parse::<i64>().ok()?;
+                    let tag_fingerprint = u64::from_str_radix(parts.next()?, 16).ok()?;
+
+                    Some(
+                        parts.next().is_none()
+                            && profile_id == self.id
+                            && tag_fingerprint == fingerprint
+                            && fresh(generated_at),
+                    )
+                };
+                matches().unwrap_or(false)
+            })
+    }
+
+    /// Compute a lighting schedule for a profile starting at `now`, see [`ScheduleCache`]
+    pub fn calculate(
+        &self,
+        now: DateTime<Utc>,
+        points: u16,
+        offset: Duration,
+    ) -> Result<LightingSchedule, Error> {
         let timezone = self.timezone.parse()?;
 
         let mut schedule = Vec::with_capacity(points.into());
@@ -96,8 +448,8 @@ impl Profile {
 
         Ok(LightingSchedule {
             profile_id: self.id,
-            sleep_start_utc_seconds: to_utc_seconds_from_midnight(self.sleep_start, timezone),
-            sleep_end_utc_seconds: to_utc_seconds_from_midnight(self.sleep_end, timezone),
+            sleep_start_utc_seconds: to_utc_seconds_from_midnight(self.sleep_start, timezone, now),
+            sleep_end_utc_seconds: to_utc_seconds_from_midnight(self.sleep_end, timezone, now),
             min_color_temp: self.min_color_temp,
             max_color_temp: self.max_color_temp,
             night_mode_enabled: self.night_mode_enabled,
@@ -4,9 +4,27 @@ use axum::{
         Path,
         State,
     },
-    http::StatusCode,
+    http::{
+        HeaderMap,
+        StatusCode,
+        header::{
+            CONTENT_TYPE,
+            ETAG,
+            IF_NONE_MATCH,
+        },
+    },
+    response::{
+        IntoResponse,
+        Response,
+    },
+};
+use tokio::{
+    sync::broadcast::error::RecvError,
+    time::{
+        Instant,
+        timeout_at,
+    },
 };
-use chrono::Duration;
 use utoipa_axum::{
     router::OpenApiRouter,
     routes,
@@ -22,7 +40,13 @@ use crate::{
             Role,
             User,
         },
-        circadian::LightingSchedule,
+        circadian::{
+            self,
+            BINARY_SCHEDULE_MEDIA_TYPE,
+            JSON_MEDIA_TYPE,
+            LightingSchedule,
+            ScheduleChange,
+        },
         profiles::{
             self,
             Profile,
@@ -36,6 +60,7 @@ use crate::{
         PostDevice,
         PutDevice,
         RegenerateDeviceKey,
+        WatchDeviceSchedule,
     },
 };
 
@@ -49,9 +74,14 @@ pub use db::Device;
 
 pub const TAG: &str = "Devices";
 
+/// How long a schedule watch is held open, below the device read timeout. Devices keep the idle
+/// connection alive with TCP keep-alive, so this only bounds how often an unchanged one polls.
+pub const SCHEDULE_WATCH_SECONDS: u64 = 15 * 60;
+
 pub fn router() -> OpenApiRouter<AppState> {
     OpenApiRouter::new()
         .routes(routes!(get_circadian))
+        .routes(routes!(watch_circadian))
         .routes(routes!(post, get_all))
         .routes(routes!(get, put, delete, regenerate_key))
 }
@@ -178,6 +208,10 @@ pub async fn put(
     })
     .await?;
 
+    state
+        .schedule_changes
+        .notify(ScheduleChange::Device(device.id));
+
     Ok(Json(device))
 }
 
@@ -240,10 +274,18 @@ pub async fn delete(
     })
     .await?;
 
+    state.schedule_changes.notify(ScheduleChange::Device(id));
+
     Ok(StatusCode::NO_CONTENT)
 }
 
 /// Get lighting schedule
+///
+/// Devices may send `Accept: application/octet-stream` to get the compact binary
+/// representation instead of JSON. A device without a profile always gets JSON `null`.
+///
+/// Schedules carry an `ETag`. Sending it back in `If-None-Match` gets `304 Not Modified` while
+/// the profile is unchanged and the schedule is less than 12 hours old.
 #[utoipa::path(
     get,
     path = "/circadian",
@@ -254,10 +296,97 @@ pub async fn delete(
 pub async fn get_circadian(
     State(state): State<AppState>,
     AuthDevice(device): AuthDevice,
-) -> Result<Json<Option<LightingSchedule>>, Error> {
+    headers: HeaderMap,
+) -> Result<Response, Error> {
     let Some(profile_id) = device.profile_id else {
-        return Ok(Json(None));
+        return Ok(Json(None::<LightingSchedule>).into_response());
     };
     let profile = Profile::get_by_id(&state.pool, profile_id).await?;
-    Ok(Json(Some(profile.calculate(96, Duration::minutes(15))?)))
+
+    if let Some(etag) = profile.current_schedule_etag(&headers) {
+        return Ok((StatusCode::NOT_MODIFIED, [(ETAG, etag)]).into_response());
+    }
+
+    let cached = state.schedule_cache.get(&profile).await?;
+
+    let (media_type, body) = if circadian::accepts_binary(&headers) {
+        (BINARY_SCHEDULE_MEDIA_TYPE, &cached.binary)
+    } else {
+        (JSON_MEDIA_TYPE, &cached.json)
+    };
+    Ok((
+        [(CONTENT_TYPE, media_type), (ETAG, cached.etag.as_str())],
+        body.clone(),
+    )
+        .into_response())
+}
+
+/// Wait for a lighting schedule change
+///
+/// Send the `ETag` of the schedule the device is using in `If-None-Match`. Answers
+/// `204 No Content` as soon as that schedule is outdated because the profile or the device
+/// changed, and the device should fetch `/circadian` again. Answers `304 Not Modified` after 15
+/// minutes without a change, the device then simply asks again. The age of a schedule is not a
+/// change, every device of a profile would be told in the same second: devices refresh ahead of
+/// `valid_until` on their own, at a time of their own.
+#[utoipa::path(
+    get,
+    path = "/circadian/watch",
+    responses(WatchDeviceSchedule),
+    tag = TAG,
+    security(("api_key" = []))
+)]
+pub async fn watch_circadian(
+    State(state): State<AppState>,
+    AuthDevice(mut device): AuthDevice,
+    headers: HeaderMap,
+) -> Result<StatusCode, Error> {
+    let deadline = Instant::now() + std::time::Duration::from_secs(SCHEDULE_WATCH_SECONDS);
+    // Subscribed before the first check so a change in between is not missed
+    let mut changes = state.schedule_changes.subscribe();
+
+    loop {
+        if schedule_is_stale(&state, &device, &headers).await? {
+            return Ok(StatusCode::NO_CONTENT);
+        }
+
+        let (device_id, profile_id) = (device.id, device.profile_id);
+        let change = async {
+            loop {
+                match changes.recv().await {
+                    Ok(change) if change.affects(device_id, profile_id) => return,
+                    Ok(_) => {}
+                    // Some were missed, one of them may have been for this device
+                    Err(RecvError::Lagged(_)) => return,
+                    Err(RecvError::Closed) => std::future::pending::<()>().await,
+                }
+            }
+        };
+        if timeout_at(deadline, change).await.is_err() {
+            return Ok(StatusCode::NOT_MODIFIED);
+        }
+
+        // Possibly spurious, check again against the current assignment
+        device = Device::get_by_id(&state.pool, device_id).await?;
+    }
+}
+
+/// Whether the schedule named in `If-None-Match` is not the one `device` should be using, its age
+/// aside
+async fn schedule_is_stale(
+    state: &AppState,
+    device: &Device,
+    headers: &HeaderMap,
+) -> Result<bool, Error> {
+    let Some(profile_id) = device.profile_id else {
+        // Without a profile there is nothing to use, but the device may still have one
+        return Ok(headers.contains_key(IF_NONE_MATCH));
+    };
+
+    match Profile::get_by_id(&state.pool, profile_id).await {
+        Ok(profile) => Ok(profile.unchanged_schedule_etag(headers).is_none()),
+        // Deleted after the device was loaded
+        Err(Error::ProfileNotFound) => Ok(true),
+        Err(error) => Err(error),
+    }
 }
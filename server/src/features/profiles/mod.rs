@@ -4,9 +4,15 @@ use axum::{
         Path,
         State,
     },
-    http::StatusCode,
+    http::{
+        StatusCode,
+        header::CONTENT_TYPE,
+    },
+    response::{
+        IntoResponse,
+        Response,
+    },
 };
-use chrono::Duration;
 use utoipa_axum::{
     router::OpenApiRouter,
     routes,
@@ -22,7 +28,10 @@ use crate::{
             Role,
             User,
         },
-        circadian::LightingSchedule,
+        circadian::{
+            JSON_MEDIA_TYPE,
+            ScheduleChange,
+        },
     },
     responses::{
         DeleteProfile,
@@ -165,6 +174,11 @@ pub async fn put(
     })
     .await?;
 
+    state.schedule_cache.invalidate(profile.id);
+    state
+        .schedule_changes
+        .notify(ScheduleChange::Profile(profile.id));
+
     Ok(Json(profile))
 }
 
@@ -190,6 +204,9 @@ pub async fn delete(
     })
     .await?;
 
+    state.schedule_cache.invalidate(id);
+    state.schedule_changes.notify(ScheduleChange::Profile(id));
+
     Ok(StatusCode::NO_CONTENT)
 }
 
@@ -209,7 +226,8 @@ pub async fn get_circadian(
     State(state): State<AppState>,
     auth: Authenticated,
     Path(id): Path<i64>,
-) -> Result<Json<LightingSchedule>, Error> {
+) -> Result<Response, Error> {
     let profile = get_raw(&state, &auth, id).await?;
-    Ok(Json(profile.calculate(96, Duration::minutes(15))?))
+    let cached = state.schedule_cache.get(&profile).await?;
+    Ok(([(CONTENT_TYPE, JSON_MEDIA_TYPE)], cached.json.clone()).into_response())
 }
@@ -49,6 +49,120 @@ pub struct CreateTelemetry {
     pub color_temp: Option<i16>,
 
     pub ambient_light: Option<i16>,
+
+    /// Unix time in seconds when the event happened on the device.
+    /// Defaults to the time the server received it, future values are clamped to it.
+    #[serde(default, with = "chrono::serde::ts_seconds_option")]
+    #[schema(value_type = Option<i64>, example = 1_735_693_200)]
+    pub timestamp: Option<DateTime<Utc>>,
+}
+
+/// Telemetry events collected by a device and uploaded in one request
+#[derive(Debug, Deserialize, Validate, ToSchema)]
+#[schema(as = CreateTelemetryBatchRequest)]
+pub struct CreateTelemetryBatch(
+    #[garde(length(min = 1, max = 256), dive)]
+    pub Vec<CreateTelemetry>,
+);
+
+/// Event types by their code in the binary batch, append only
+pub const EVENT_TYPES: [&str; 3] = ["motion_detected", "motion_timeout", "mode_change"];
+
+impl CreateTelemetryBatch {
+    /// Version byte of the layout read by [`Self::from_bytes`]
+    pub const BINARY_VERSION: u8 = 1;
+
+    /// Decode the compact layout sent by devices.
+    ///
+    /// | bytes | field |
+    /// |-------|-------|
+    /// | 1 | version, [`Self::BINARY_VERSION`] |
+    /// | 1 | number of events |
+    ///
+    /// Followed by every event:
+    ///
+    /// | bytes | field |
+    /// |-------|-------|
+    /// | 1 | bits 0-3 event type, see [`EVENT_TYPES`], bit 4 `motion_detected`, bit 5 `light_is_on`, bit 6 has `color_temp`, bit 7 has `timestamp` |
+    /// | 1 | `brightness` |
+    /// | varint | `color_temp` if present |
+    /// | varint | `timestamp` in unix seconds if present |
+    ///
+    /// Varints are LEB128 of the zigzag encoded difference to the same field of the previous
+    /// event that had it, the first one to 0.
+    pub fn from_bytes(bytes: &[u8]) -> Result<Self, Error> {
+        let mut bytes = bytes.iter().copied();
+
+        if read_u8(&mut bytes, "version")? != Self::BINARY_VERSION {
+            return Err(Error::InvalidTelemetry("unsupported version".into()));
+        }
+        let count = read_u8(&mut bytes, "count")?;
+
+        let mut events = Vec::with_capacity(count.into());
+        let (mut previous_color_temp, mut previous_timestamp) = (0_i64, 0_i64);
+        for _ in 0..count {
+            let head = read_u8(&mut bytes, "event")?;
+            let brightness = read_u8(&mut bytes, "brightness")?;
+
+            let event_type = *EVENT_TYPES
+                .get(usize::from(head & 0x0f))
+                .ok_or_else(|| Error::InvalidTelemetry("unknown event type".into()))?;
+
+            let color_temp = if head & 0x40 == 0 {
+                None
+            } else {
+                previous_color_temp += read_varint(&mut bytes, "color_temp")?;
+                Some(
+                    i16::try_from(previous_color_temp)
+                        .map_err(|_| Error::InvalidTelemetry("color_temp out of range".into()))?,
+                )
+            };
+            let timestamp = if head & 0x80 == 0 {
+                None
+            } else {
+                previous_timestamp += read_varint(&mut bytes, "timestamp")?;
+                Some(
+                    DateTime::from_timestamp(previous_timestamp, 0)
+                        .ok_or_else(|| Error::InvalidTelemetry("timestamp out of range".into()))?,
+                )
+            };
+
+            events.push(CreateTelemetry {
+                event_type: event_type.to_owned(),
+                motion_detected: Some(head & 0x10 != 0),
+                light_is_on: Some(head & 0x20 != 0),
+                brightness: Some(brightness.into()),
+                color_temp,
+                ambient_light: None,
+                timestamp,
+            });
+        }
+
+        if bytes.next().is_some() {
+            return Err(Error::InvalidTelemetry("trailing bytes".into()));
+        }
+        Ok(Self(events))
+    }
+}
+
+fn read_u8(bytes: &mut impl Iterator<Item = u8>, field: &str) -> Result<u8, Error> {
+    bytes
+        .next()
+        .ok_or_else(|| Error::InvalidTelemetry(format!("{field} is missing")))
+}
+
+/// Zigzag LEB128, see [`CreateTelemetryBatch::from_bytes`]
+fn read_varint(bytes: &mut impl Iterator<Item = u8>, field: &str) -> Result<i64, Error> {
+    let mut value = 0_u64;
+    for shift in (0..64).step_by(7) {
+        let byte = read_u8(bytes, field)?;
+        value |= u64::from(byte & 0x7f) << shift;
+        if byte & 0x80 == 0 {
+            #[allow(clippy::cast_possible_wrap)]
+            return Ok((value >> 1) as i64 ^ -((value & 1) as i64));
+        }
+    }
+    Err(Error::InvalidTelemetry(format!("{field} is too long")))
 }
 
 impl Telemetry {
@@ -62,8 +176,8 @@ impl Telemetry {
             Self,
             "INSERT INTO telemetry (
                 device_id, event_type, motion_detected, light_is_on, brightness,
-                color_temp, ambient_light
-             ) VALUES ($1, $2, $3, $4, $5, $6, $7)
+                color_temp, ambient_light, created_at
+             ) VALUES ($1, $2, $3, $4, $5, $6, $7, LEAST(COALESCE($8, NOW()), NOW()))
              RETURNING *
             ",
             device_id,
@@ -72,7 +186,8 @@ impl Telemetry {
             data.light_is_on,
             data.brightness,
             data.color_temp,
-            data.ambient_light
+            data.ambient_light,
+            data.timestamp
         )
         .fetch_one(pool)
         .await?;
@@ -80,6 +195,60 @@ impl Telemetry {
         Ok(telemetry)
     }
 
+    /// Create telemetry entries from a batch in a single query, returns the number of rows
+    pub async fn create_batch(
+        pool: &PgPool,
+        device_id: i64,
+        data: Valid<CreateTelemetryBatch>,
+    ) -> Result<u64, Error> {
+        let events = data.into_inner().0;
+
+        let mut event_types = Vec::with_capacity(events.len());
+        let mut motion_detected = Vec::with_capacity(events.len());
+        let mut light_is_on = Vec::with_capacity(events.len());
+        let mut brightness = Vec::with_capacity(events.len());
+        let mut color_temp = Vec::with_capacity(events.len());
+        let mut ambient_light = Vec::with_capacity(events.len());
+        let mut timestamps = Vec::with_capacity(events.len());
+
+        for event in events {
+            event_types.push(event.event_type);
+            motion_detected.push(event.motion_detected);
+            light_is_on.push(event.light_is_on);
+            brightness.push(event.brightness);
+            color_temp.push(event.color_temp);
+            ambient_light.push(event.ambient_light);
+            timestamps.push(event.timestamp);
+        }
+
+        Ok(sqlx::query!(
+            "INSERT INTO telemetry (
+                device_id, event_type, motion_detected, light_is_on, brightness,
+                color_temp, ambient_light, created_at
+             )
+             SELECT $1, event_type, motion_detected, light_is_on, brightness,
+                color_temp, ambient_light, LEAST(COALESCE(created_at, NOW()), NOW())
+             FROM UNNEST(
+                $2::TEXT[], $3::BOOLEAN[], $4::BOOLEAN[], $5::SMALLINT[],
+                $6::SMALLINT[], $7::SMALLINT[], $8::TIMESTAMPTZ[]
+             ) AS t(
+                event_type, motion_detected, light_is_on, brightness,
+                color_temp, ambient_light, created_at
+             )",
+            device_id,
+            &event_types as &[String],
+            &motion_detected as &[Option<bool>],
+            &light_is_on as &[Option<bool>],
+            &brightness as &[Option<i16>],
+            &color_temp as &[Option<i16>],
+            &ambient_light as &[Option<i16>],
+            &timestamps as &[Option<DateTime<Utc>>]
+        )
+        .execute(pool)
+        .await?
+        .rows_affected())
+    }
+
     pub async fn get_by_id(pool: &PgPool, id: i64) -> Result<Self, Error> {
         sqlx::query_as!(Self, "SELECT * FROM telemetry WHERE id = $1", id)
             .fetch_optional(pool)
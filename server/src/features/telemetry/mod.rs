@@ -1,16 +1,26 @@
 use axum::{
     Json,
+    body::Bytes,
     extract::{
+        FromRequest,
         Path,
         Query,
+        Request,
         State,
     },
-    http::StatusCode,
+    http::{
+        StatusCode,
+        header::CONTENT_TYPE,
+    },
 };
 use chrono::{
     DateTime,
     Utc,
 };
+use garde::{
+    Unvalidated,
+    Valid,
+};
 use serde::Deserialize;
 use utoipa::IntoParams;
 use utoipa_axum::{
@@ -39,21 +49,60 @@ use crate::{
         GetOneTelemetry,
         GetTelemetry,
         PostTelemetry,
+        PostTelemetryBatch,
     },
 };
 
 mod db;
 
-use db::CreateTelemetry;
+use db::{
+    CreateTelemetry,
+    CreateTelemetryBatch,
+};
 
 pub use db::Telemetry;
 
 pub const TAG: &str = "Telemetry";
 
+/// Media type of the compact batch representation, see [`CreateTelemetryBatch::from_bytes`]
+pub const BINARY_TELEMETRY_MEDIA_TYPE: &str = "application/octet-stream";
+
+/// A [`CreateTelemetryBatch`] from JSON, or from the compact representation when sent as
+/// [`BINARY_TELEMETRY_MEDIA_TYPE`]
+pub struct TelemetryBatch(Valid<CreateTelemetryBatch>);
+
+impl<S> FromRequest<S> for TelemetryBatch
+where
+    S: Send + Sync,
+{
+    type Rejection = Error;
+
+    async fn from_request(req: Request, state: &S) -> Result<Self, Self::Rejection> {
+        let binary = req
+            .headers()
+            .get(CONTENT_TYPE)
+            .and_then(|value| value.to_str().ok())
+            .is_some_and(|value| value.starts_with(BINARY_TELEMETRY_MEDIA_TYPE));
+        if !binary {
+            let Validated(data) =
+                Validated::<CreateTelemetryBatch>::from_request(req, state).await?;
+            return Ok(Self(data));
+        }
+
+        let bytes = Bytes::from_request(req, state)
+            .await
+            .map_err(|rejection| Error::InvalidTelemetry(rejection.body_text()))?;
+        let data = CreateTelemetryBatch::from_bytes(&bytes)?;
+
+        Ok(Self(Unvalidated::new(data).validate()?))
+    }
+}
+
 pub fn router() -> OpenApiRouter<AppState> {
     OpenApiRouter::new()
         .routes(routes!(get))
         .routes(routes!(get_all, post))
+        .routes(routes!(post_batch))
         .routes(routes!(get_by_device, delete))
 }
 
@@ -185,6 +234,31 @@ pub async fn post(
     Ok((StatusCode::CREATED, Json(telemetry)))
 }
 
+/// Create telemetry entries in bulk
+///
+/// Called by devices using their key authentication.
+/// Returns the number of stored entries.
+///
+/// Devices may send `Content-Type: application/octet-stream` with the compact binary
+/// representation instead of JSON, a few bytes per event.
+#[utoipa::path(
+    post,
+    path = "/batch",
+    request_body = CreateTelemetryBatch,
+    responses(PostTelemetryBatch),
+    tag = TAG,
+    security(("api_key" = []))
+)]
+pub async fn post_batch(
+    State(state): State<AppState>,
+    AuthDevice(device): AuthDevice,
+    TelemetryBatch(data): TelemetryBatch,
+) -> Result<(StatusCode, Json<u64>), Error> {
+    let count = Telemetry::create_batch(&state.pool, device.id, data).await?;
+
+    Ok((StatusCode::CREATED, Json(count)))
+}
+
 /// Delete device telemetry entries
 ///
 /// Owner or User may delete **only** their own telemetry.
@@ -25,6 +25,8 @@ mod features {
 struct AppState {
     pool: sqlx::PgPool, // pool cloning is cheap
     jwt_secret: String,
+    schedule_changes: features::circadian::ScheduleChanges,
+    schedule_cache: features::circadian::ScheduleCache,
 }
 
 #[tokio::main]
@@ -52,7 +54,12 @@ async fn main() {
         "could not get JWT_SECRET environment variable",
     );
 
-    let state = AppState { pool, jwt_secret };
+    let state = AppState {
+        pool,
+        jwt_secret,
+        schedule_changes: features::circadian::ScheduleChanges::default(),
+        schedule_cache: features::circadian::ScheduleCache::default(),
+    };
     let router = router::router().with_state(state);
 
     // Support for `systemfd --no-pid -s http::3000 -- cargo watch -x run`
@@ -242,6 +242,19 @@ error_set! {
         /// Got device lighting schedule successfully
         #[response(status = OK)]
         Success(Option<LightingSchedule>),
+        /// The schedule named in `If-None-Match` is still current
+        #[response(status = NOT_MODIFIED)]
+        NotModified,
+    }
+    #[derive(IntoResponses)]
+    #[skip(Error,Display,Debug)]
+    WatchDeviceSchedule := InternalServerError || Unauthorized || DeviceNotFound || {
+        /// The schedule named in `If-None-Match` is outdated, fetch it again
+        #[response(status = NO_CONTENT)]
+        Changed,
+        /// No change while waiting
+        #[response(status = NOT_MODIFIED)]
+        NotModified,
     }
     #[derive(IntoResponses)]
     #[skip(Error,Display,Debug)]
@@ -327,6 +340,13 @@ error_set! {
     }
     #[derive(IntoResponses)]
     #[skip(Error,Display,Debug)]
+    PostTelemetryBatch := ValidInternalAuth || {
+        /// Telemetry batch stored successfully, returns the number of entries
+        #[response(status = CREATED)]
+        Success(u64),
+    }
+    #[derive(IntoResponses)]
+    #[skip(Error,Display,Debug)]
     DeleteTelemetry := InternalServerError || Unauthorized || {
         /// Telemetry deleted successfully
         #[response(status = OK)]